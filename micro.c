@@ -5,10 +5,22 @@
 
 // ctype.h - character handling functions
 #include <ctype.h>
+// dirent.h - listing the syntax directory
+#include <dirent.h>
 // errno.h - error numbers
 #include <errno.h>
 // fcntl.h - file control options
 #include <fcntl.h>
+// limits.h - implementation limits
+#include <limits.h>
+// malloc.h - malloc_usable_size, for the allocator overhead
+#include <malloc.h>
+// poll.h - waiting on several file descriptors
+#include <poll.h>
+// pthread.h - threads for the background search
+#include <pthread.h>
+// signal.h - window resize notification
+#include <signal.h>
 // stdio.h - standard input/output
 #include <stdio.h>
 // stdlib.h - standard library
@@ -19,8 +31,14 @@
 #include <string.h>
 // sys/ioctl.h - input/output control
 #include <sys/ioctl.h>
+// sys/mman.h - memory mapping
+#include <sys/mman.h>
+// sys/stat.h - file status
+#include <sys/stat.h>
 // sys/types.h - system types
 #include <sys/types.h>
+// sys/uio.h - vectored i/o for saving
+#include <sys/uio.h>
 // termios.h - terminal input/output
 #include <termios.h>
 // time.h - time functions
@@ -28,10 +46,66 @@
 // unistd.h - standard symbolic constants and types
 #include <unistd.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__SSE2__)
+// immintrin.h - SSE2/AVX2 intrinsics for the search prefilter
+#include <immintrin.h>
+#define MICRO_SEARCH_SIMD
+#endif
+
 /*** defines ***/
 #define MICRO_VERSION "0.0.1"
 #define MICRO_TAB_STOP 8
+// bytes between the column checkpoints of a long row, see editorRowColsTo
+#define MICRO_COL_STRIDE 256
+// rows at least this many bytes long are only rendered around the screen
+#define MICRO_LONG_ROW 16384
+// columns rendered on either side of the screen for such a row
+#define MICRO_LONG_MARGIN 512
 #define MICRO_QUIT_TIMES 3
+// lines per span node built by editorOpen
+#define MICRO_SPAN_LINES 512
+// bytes per slab arena, see slabAlloc
+#define MICRO_SLAB_ARENA (1 << 20)
+// rows kept rendered, in screens worth of rows
+#define MICRO_CACHE_SCREENS 4
+// time spent lexing ahead of the screen per idle tick, in milliseconds
+#define MICRO_LEX_SLICE_MS 20
+// pieces gathered per writev when saving
+#define MICRO_SAVE_IOV 256
+// bytes of terminal input read per syscall
+#define MICRO_INBUF 16384
+// how long the rest of an escape sequence may take to arrive
+#define MICRO_ESC_TIMEOUT_MS 100
+// how long a status message stays up
+#define MICRO_STATUS_MS 5000
+// descriptors and timers the reactor can watch besides the terminal
+#define MICRO_WATCHES 8
+#define MICRO_TIMERS 8
+// shortest time between two frames, about 60 per second
+#define MICRO_FRAME_MS 16
+// longest a burst of input may hold back a frame
+#define MICRO_FRAME_STALL_MS 100
+// bytes the undo log may hold; the environment variable of the same name
+// overrides it
+#define MICRO_UNDO_LIMIT (16 << 20)
+// most threads lexing a file as it is opened; one per core by default, and
+// the environment variable of the same name overrides it
+#define MICRO_LEX_THREADS 16
+// bytes of DFA states a regex may cache per direction before the cache is
+// thrown away and rebuilt from the state the scan is in, see regexStep
+#define MICRO_REGEX_CACHE (2 << 20)
+// instructions a compiled regex may take, which bounds x{1000}-style counts
+#define MICRO_REGEX_PROG 65536
+// groups and repeats a regex may nest, which bounds the recursion of the
+// parser and of regexEmit
+#define MICRO_REGEX_DEPTH 1000
+// histogram buckets per profiled stage: bucket i counts times of 2^i to
+// 2^(i+1) nanoseconds
+#define PROF_BUCKETS 40
+// screen size of micro --bench unless --size gives one
+#define MICRO_BENCH_ROWS 50
+#define MICRO_BENCH_COLS 160
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -45,7 +119,9 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  // a bracketed paste; the text is in E.paste
+  PASTE_KEY
 };
 
 enum editorHighlight {
@@ -59,10 +135,49 @@ enum editorHighlight {
   HL_MATCH
 };
 
+// the stages of handling input and drawing it that editorProfile times
+enum profStage {
+  PROF_KEY = 0,
+  PROF_EDIT,
+  PROF_SYNTAX,
+  PROF_DRAW,
+  PROF_FLUSH,
+  PROF_IDLE,
+  PROF_STAGES
+};
+
+// what tracked memory is for, see memAlloc
+enum memTag {
+  MEM_TEXT = 0,
+  MEM_RENDER,
+  MEM_HL,
+  MEM_TREE,
+  MEM_FILE,
+  MEM_UNDO,
+  MEM_SEARCH,
+  MEM_SCREEN,
+  MEM_INPUT,
+  MEM_SYNTAX,
+  MEM_COLS,
+  MEM_OVERHEAD,
+  MEM_TAGS
+};
+
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// what a byte is to the highlighter, see editorSyntax.cls
+#define SYN_SEP (1 << 0)
+#define SYN_QUOTE (1 << 1)
+
 /*** data ***/
+// one slot of a compiled keyword table; word is NULL in empty slots
+struct editorKeyword {
+  const char *word;
+  int len;
+  int hl;
+};
+
 struct editorSyntax {
   char *filetype;
   char **filematch;
@@ -71,18 +186,368 @@ struct editorSyntax {
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  // kwtable - open-addressed hash of keywords, built on first selection
+  struct editorKeyword *kwtable;
+  unsigned int kwmask;
+  // kwmax - length of the longest keyword
+  int kwmax;
+  // cls - SYN_ bits of every byte value
+  unsigned char cls[256];
+};
+
+// highlighter state at a byte of a line, enough to carry on from there;
+// in_comment is 2 once a single-line comment started
+struct hlState {
+  int pos;
+  int in_comment;
+  int in_string;
+  int prev_sep;
+  int prev_hl;
+};
+
+// the part of a long row that is rendered, see editorRenderWindow
+struct rowWindow {
+  // col - render column of render[0]; chars[from, to) are rendered
+  int col;
+  int from;
+  int to;
+  // hls[k] - highlighter state at byte k * MICRO_COL_STRIDE, for k below nhls
+  struct hlState *hls;
+  int nhls;
+  // mark - the first checkpoint past the last edit as it was before it,
+  // moved along with the bytes; only set while marked, see editorRowColsTrim
+  struct hlState mark;
+  int marked;
 };
 
+#define ROW_BORROWED (1 << 0)
+// the node is a span of unopened lines of E.orig, see editorOpen
+#define ROW_SPAN (1 << 1)
+// render/hl no longer match chars; refilled by editorRowCache
+#define ROW_RENDER_DIRTY (1 << 2)
+#define ROW_HL_DIRTY (1 << 3)
+// the row is linked into the render cache list
+#define ROW_CACHED (1 << 4)
+// render is chars itself, as the row has no tabs to expand
+#define ROW_RENDER_ALIAS (1 << 5)
+
+#define ATTR_INVERSE 0x80
+// never drawn, marks shadow cells that have to be sent again
+#define ATTR_UNKNOWN 0xff
+
+// for a span node, chars/size cover the raw bytes of all its lines (newlines
+// included) and hl_open_comment is the lexer state after its last line
 typedef struct erow {
-  int idx;
   int size;
   int rsize;
+  // chars - row text; not NUL-terminated while ROW_BORROWED is set
   char *chars;
+  // render - chars with tabs expanded, or chars itself, see ROW_RENDER_ALIAS
   char *render;
+  // hl - highlight of render as hlruns (length, class) byte pairs
   unsigned char *hl;
   int hl_open_comment;
+  int flags;
+  // cols[k] - render column of byte (k + 1) * MICRO_COL_STRIDE, for k below
+  // ncols; only built for long rows, and only as far as it was needed
+  int *cols;
+  int ncols;
+  int hlruns;
+  // win - set while the row is rendered as a window, see MICRO_LONG_ROW
+  struct rowWindow *win;
+  // cache_prev, cache_next - links in the render cache, most recent first
+  struct erow *cache_prev;
+  struct erow *cache_next;
 } erow;
 
+// rows live in an implicit treap ordered by position; erow must stay the
+// first member so an erow pointer can be cast back to its node
+typedef struct rownode {
+  erow row;
+  struct rownode *left;
+  struct rownode *right;
+  struct rownode *parent;
+  unsigned int prio;
+  // nlines - rows held by this node, 1 unless it is a span
+  int nlines;
+  // count - number of rows in this subtree
+  int count;
+  // nbytes - bytes the node's rows take in the saved file, newlines
+  // included; bytes - the same for the subtree
+  long long nbytes;
+  long long bytes;
+} rownode;
+
+// a compiled search needle, see searcherInit
+struct searcher {
+  const char *needle;
+  int len;
+  int avx2;
+  // skip - Horspool shift for each byte value
+  int skip[256];
+};
+
+// the instructions of a Thompson NFA, see regexCompile
+enum regexOp { RE_BYTE, RE_SPLIT, RE_JMP, RE_BOL, RE_EOL, RE_MATCH };
+struct regexInst {
+  int op;
+  // x - the byte set of RE_BYTE, the target of RE_JMP and the preferred
+  // branch of RE_SPLIT; y - the other branch
+  int x;
+  int y;
+};
+
+#define RS_MATCH (1 << 0)
+#define RS_EOLMATCH (1 << 1)
+#define RS_DEAD (1 << 2)
+
+// a DFA state: the NFA threads alive at a point of the scan, in priority
+// order. next holds one transition per byte class, NULL until first taken
+struct regexState {
+  int *pcs;
+  int n;
+  // RS_MATCH - the bytes read end a match; RS_EOLMATCH - they do if the
+  // line ends here; RS_DEAD - no thread is left
+  int flags;
+  unsigned hash;
+  struct regexState *next[];
+};
+// the DFA of one program, built lazily as the scan needs its states
+struct regexDfa {
+  struct regexInst *prog;
+  int nprog;
+  // cut - leftmost-first: threads behind a match are dropped
+  int cut;
+  struct regexState **table;
+  int tablecap;
+  int nstates;
+  size_t bytes;
+  // start - the first state, for a scan away from and at the line start
+  struct regexState *start[2];
+  // list, stack and seen are scratch for regexClosure
+  int *list;
+  int *stack;
+  unsigned *seen;
+  unsigned mark;
+};
+// a compiled regex: fwd finds where the leftmost match ends, rev reads
+// back from there to where it starts
+struct regex {
+  unsigned char (*sets)[32];
+  int nsets;
+  // cls - the class of each byte; bytes in a class are in the same sets,
+  // so they share every transition. rep - a byte of each class
+  unsigned char cls[256];
+  unsigned char rep[256];
+  int ncls;
+  // must - a string every match contains, so lines without it can be
+  // skipped with searchFind, as grep does
+  char must[64];
+  int mustlen;
+  struct regexDfa fwd;
+  struct regexDfa rev;
+};
+
+// one match: row and byte offset into its chars, and its length; p points
+// at the text and avail is the number of bytes left on the line from there
+struct searchMatch {
+  int row;
+  int col;
+  int len;
+  const char *p;
+  int avail;
+};
+struct searchMatches {
+  struct searchMatch *m;
+  int n;
+  int cap;
+};
+// a piece of the document as it was when the prompt opened; the worker
+// scans these instead of the row tree, which the main thread keeps changing
+struct searchPiece {
+  const char *chars;
+  int size;
+  int line;
+  int span;
+};
+struct editorSearch {
+  char *query;
+  int qlen;
+  // cur - index of the match the cursor is on, or -1
+  int cur;
+  // res and done are shared with the worker and guarded by lock; done is
+  // set once res holds every match of query
+  struct searchMatches res;
+  int done;
+  struct searchPiece *pieces;
+  int npieces;
+  // regex - the query is a regex, toggled by Ctrl-R; error - why it does
+  // not compile, set by the worker
+  int regex;
+  const char *error;
+  // job - a query waiting for the worker; gen - bumped by every new job,
+  // so the worker can tell that the scan it is running went stale
+  char *job;
+  int joblen;
+  int jobregex;
+  unsigned gen;
+  int busy;
+  int started;
+  // the worker writes a byte to notify[1] whenever it has new results
+  int notify[2];
+  pthread_t worker;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+};
+
+// a span of a freshly opened file as the lex threads see it: its text,
+// its lines, the line after it, and the lexer state at its end
+struct lexSpan {
+  const char *s;
+  int size;
+  int nlines;
+  int end;
+  int out;
+};
+
+// spans [from, to) lexed by one thread, see editorSyntaxLexStart
+struct lexChunk {
+  pthread_t thread;
+  int from;
+  int to;
+};
+
+struct editorLex {
+  // running - threads are lexing spans; cancel - asks them to stop early;
+  // done - chunks lexed; finished - set, and notify[1] written to, by the
+  // last thread once the states are all right
+  int running;
+  int cancel;
+  int done;
+  int finished;
+  // edited - the text changed meanwhile, so the states are of no use
+  int edited;
+  struct lexSpan *spans;
+  int nspans;
+  struct lexChunk chunks[MICRO_LEX_THREADS];
+  int nchunks;
+  int notify[2];
+};
+
+// one character cell of the screen; attr is an editorHighlight value, with
+// ATTR_INVERSE for reverse video
+struct cell {
+  char ch;
+  unsigned char attr;
+};
+
+// the reactor calls fn when fd becomes readable
+struct editorWatch {
+  int fd;
+  void (*fn)(int fd);
+};
+// one-shot timer, at is in milliseconds on the monotonic clock
+struct editorTimer {
+  long long at;
+  void (*fn)(void);
+};
+
+enum undoType { UNDO_INSERT, UNDO_DELETE, UNDO_ROW_INSERT, UNDO_ROW_DELETE };
+
+// one edit in the undo log. Its text follows it, padded to 8 bytes, unless
+// it is unedited file contents: then orig is its offset in E.orig, which
+// never changes, and nothing is copied. size is repeated in the last 8
+// bytes of the record so the log can be walked backwards
+struct undoRecord {
+  // group - keypress that made the edit; undo and redo take whole groups
+  unsigned int group;
+  int type;
+  int row;
+  int col;
+  int len;
+  // cursor before and after the group
+  int cx, cy;
+  int acx, acy;
+  long long orig;
+  long long size;
+};
+
+struct editorUndo {
+  char *log;
+  size_t len;
+  size_t cap;
+  // records before pos are done, the ones after it can be redone
+  size_t pos;
+  size_t limit;
+  unsigned int group;
+  // cursor when the key of the current group was pressed
+  int cx, cy;
+  // skip - a group too big for the log, it is not recorded
+  unsigned int skip;
+  // set while undo and redo edit the rows, which must not record
+  int replay;
+};
+
+struct profHist {
+  long long count;
+  long long total;
+  long long max;
+  long long buckets[PROF_BUCKETS];
+};
+
+struct editorProfile {
+  // overlay - show the last frame in the message bar
+  int overlay;
+  struct profHist hist[PROF_STAGES];
+  // time per stage since the last frame, and for the frame before it
+  long long frame[PROF_STAGES];
+  long long last[PROF_STAGES];
+  int last_bytes;
+  int last_keys;
+  int last_depth;
+  // prompts opened so far; a key that opens one is not an edit
+  int prompts;
+  // fill - time spent in inputFill, waiting for input and running the
+  // reactor meanwhile; it is taken out of the key stage
+  long long fill;
+};
+
+// live and peak are bytes asked for; blocks is how many allocations they
+// are spread over. What the allocator takes on top, block headers and
+// unused slab arena space, is counted under MEM_OVERHEAD
+struct memStats {
+  long long live;
+  long long peak;
+  long long blocks;
+};
+
+// free blocks of a size class are chained through their first bytes
+struct slabBlock {
+  struct slabBlock *next;
+};
+
+// blocks too big for a class are linked up, so they go with the arenas
+struct slabBig {
+  struct slabBig *prev;
+  struct slabBig *next;
+};
+
+#define SLAB_CLASSES 24
+
+struct editorSlab {
+  // arenas - chained through their first bytes; cur, left - the unused
+  // tail of the newest one
+  char *arenas;
+  char *cur;
+  size_t left;
+  struct slabBlock *free[SLAB_CLASSES];
+  struct slabBig *big;
+  // what the classes hand out per tag, counted out again by slabRelease
+  long long live[MEM_TAGS];
+  long long blocks[MEM_TAGS];
+};
+
 struct editorConfig {
   int cx, cy;
   int rx;
@@ -91,12 +556,78 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
-  erow *row;
+  rownode *rows;
+  // orig - file contents as read by editorOpen, never modified
+  char *orig;
+  size_t origlen;
+  int origmapped;
+  // rows with render/hl allocated, see editorRowCache
+  erow *cache_head;
+  erow *cache_tail;
+  int cached;
+  // hlbuf - one class per column, filled by editorHighlightRow
+  unsigned char *hlbuf;
+  int hlcap;
+  // match_row - row of the current search match overlay, or -1
+  int match_row;
+  int match_col;
+  int match_len;
+  struct editorSearch search;
+  struct editorLex lex;
+  // rows from hl_from on may hold a stale hl_open_comment; rows up to hl_to
+  // were edited since they were last lexed. See editorSyntaxSettle
+  int hl_from;
+  int hl_to;
+  // lex_threads - threads editorSyntaxLexStart may use
+  int lex_threads;
   int dirty;
   char *filename;
-  char statusmsg[80];
+  char statusmsg[256];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  // syntaxdb - the syntax cache, see editorSyntaxLoad; filesyntax is the
+  // entry of it that was selected last
+  char *syntaxdb;
+  size_t syntaxdblen;
+  int syntaxdbmapped;
+  struct editorSyntax filesyntax;
+  // screen - the frame being drawn; shadow - what the terminal shows, see
+  // screenFlush. Both cover the text rows and the two bars
+  struct cell *screen;
+  struct cell *shadow;
+  // term_y, term_x - where the terminal cursor is, or -1 if unknown
+  int term_y;
+  int term_x;
+  // input read from the terminal; bytes before inpos are decoded
+  char inbuf[MICRO_INBUF];
+  int inlen;
+  int inpos;
+  // frame_at - when the last frame was drawn; frame_keys - keys handled
+  // since; input_depth - input bytes still queued when it was drawn
+  long long frame_at;
+  int frame_keys;
+  int input_depth;
+  struct editorWatch watches[MICRO_WATCHES];
+  int nwatches;
+  struct editorTimer timers[MICRO_TIMERS];
+  int ntimers;
+  // SIGWINCH writes to winch[1], see editorResize
+  int winch[2];
+  // text of the last bracketed paste
+  char *paste;
+  int pastelen;
+  int pastecap;
+  struct editorUndo undo;
+  struct editorProfile prof;
+  // mem - heap use per memTag; mem_live, mem_peak - all tags together
+  struct memStats mem[MEM_TAGS];
+  struct editorSlab slab;
+  long long mem_live;
+  long long mem_peak;
+  // headless - driven by editorBench without a terminal; frames go to sink,
+  // which only counts their bytes
+  int headless;
+  long long sink;
   struct termios orig_termios;
 };
 
@@ -113,29 +644,459 @@ char *C_HL_keywords[] = {"switch",    "if",      "while",   "for",    "break",
 
 struct editorSyntax HLDB[] = {
     {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS, NULL, 0, 0, {0}},
 };
 
 // number of elements in HLDB
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
 /*** prototypes ***/
+void die(const char *s);
+int editorIdle();
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+int editorSyntaxLexLong(erow *row, int in_comment);
+
+/*** reactor ***/
+
+long long nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+long long nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void editorWatchFd(int fd, void (*fn)(int fd)) {
+  if (E.nwatches == MICRO_WATCHES) die("editorWatchFd");
+  E.watches[E.nwatches].fd = fd;
+  E.watches[E.nwatches].fn = fn;
+  E.nwatches++;
+}
+
+// run fn once, ms from now; a timer already set for fn is moved
+void editorTimerSet(int ms, void (*fn)(void)) {
+  int i;
+  for (i = 0; i < E.ntimers && E.timers[i].fn != fn; i++)
+    ;
+  if (i == E.ntimers) {
+    if (E.ntimers == MICRO_TIMERS) die("editorTimerSet");
+    E.ntimers++;
+  }
+  E.timers[i].at = nowMs() + ms;
+  E.timers[i].fn = fn;
+}
+
+void editorTimerCancel(void (*fn)(void)) {
+  int i;
+  for (i = 0; i < E.ntimers; i++) {
+    if (E.timers[i].fn == fn) {
+      E.timers[i] = E.timers[--E.ntimers];
+      return;
+    }
+  }
+}
+
+// a pipe whose ends never block, for waking the reactor up
+void editorPipe(int fds[2]) {
+  if (pipe(fds) == -1) die("pipe");
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+void editorDrain(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+// wait for terminal input for up to timeout milliseconds (forever if
+// negative); meanwhile serve the watched descriptors and due timers, and
+// run idle work when nothing else is going on. An idle editor with
+// nothing left to do sleeps in poll. Returns whether input is ready
+int editorPoll(int timeout) {
+  long long deadline = timeout < 0 ? -1 : nowMs() + timeout;
+  int idle = 1;
+  while (1) {
+    struct pollfd fds[MICRO_WATCHES + 1];
+    int i, n = E.nwatches;
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    for (i = 0; i < n; i++) {
+      fds[i + 1].fd = E.watches[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+
+    long long now = nowMs();
+    long long until = deadline;
+    for (i = 0; i < E.ntimers; i++)
+      if (until == -1 || E.timers[i].at < until) until = E.timers[i].at;
+    int wait = until == -1 ? -1 : until > now ? (int)(until - now) : 0;
+    if (idle) wait = 0;
+
+    int ready = poll(fds, n + 1, wait);
+    if (ready == -1 && errno != EINTR) die("poll");
+
+    for (i = 0; ready > 0 && i < n; i++)
+      if (fds[i + 1].revents) E.watches[i].fn(fds[i + 1].fd);
+    now = nowMs();
+    for (i = 0; i < E.ntimers; i++) {
+      if (E.timers[i].at <= now) {
+        void (*fn)(void) = E.timers[i].fn;
+        E.timers[i--] = E.timers[--E.ntimers];
+        fn();
+      }
+    }
+
+    if (ready > 0 && fds[0].revents) return 1;
+    if (deadline != -1 && now >= deadline) return 0;
+    if (ready == 0 && idle) idle = editorIdle();
+  }
+}
+
+/*** profile ***/
+
+const char *prof_names[PROF_STAGES] = {"key",  "edit",  "syntax",
+                                       "draw", "write", "idle"};
+
+// count ns against stage; cheap enough to stay on all the time
+void profAdd(int stage, long long ns) {
+  struct profHist *h = &E.prof.hist[stage];
+  int b = 0;
+  while (b < PROF_BUCKETS - 1 && ns >> (b + 1)) b++;
+  h->buckets[b]++;
+  h->count++;
+  h->total += ns;
+  if (ns > h->max) h->max = ns;
+  E.prof.frame[stage] += ns;
+}
+
+// a frame was written: its stages become the ones the overlay shows
+void profFrame(int bytes) {
+  struct editorProfile *p = &E.prof;
+  memcpy(p->last, p->frame, sizeof(p->last));
+  memset(p->frame, 0, sizeof(p->frame));
+  p->last_bytes = bytes;
+  p->last_keys = E.frame_keys;
+  p->last_depth = E.input_depth;
+}
+
+// "key .004 edit .031 syntax .120 draw .052 write .017 ms | 52 B | 1 key"
+void profOverlay(char *buf, int size) {
+  struct editorProfile *p = &E.prof;
+  int i, len = 0;
+  for (i = 0; i < PROF_IDLE && len < size; i++)
+    len += snprintf(&buf[len], size - len, "%s %.3f ", prof_names[i],
+                    p->last[i] / 1e6);
+  if (len < size)
+    snprintf(&buf[len], size - len, "ms | %d B | %d key%s, %d queued",
+             p->last_bytes, p->last_keys, p->last_keys == 1 ? "" : "s",
+             p->last_depth);
+}
+
+// "512 ns", "65.5 us", "2.1 ms"
+void formatNs(char *buf, int size, long long ns) {
+  if (ns < 1000)
+    snprintf(buf, size, "%lld ns", ns);
+  else if (ns < 1000000)
+    snprintf(buf, size, "%.3g us", ns / 1e3);
+  else if (ns < 1000000000)
+    snprintf(buf, size, "%.3g ms", ns / 1e6);
+  else
+    snprintf(buf, size, "%.3g s", ns / 1e9);
+}
+
+int profDump(const char *filename) {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) return -1;
+  int i, b;
+  fprintf(fp, "%-8s %10s %12s %10s %10s\n", "stage", "count", "total ms",
+          "mean us", "max us");
+  for (i = 0; i < PROF_STAGES; i++) {
+    struct profHist *h = &E.prof.hist[i];
+    fprintf(fp, "%-8s %10lld %12.3f %10.3f %10.3f\n", prof_names[i], h->count,
+            h->total / 1e6, h->count ? h->total / 1e3 / h->count : 0.0,
+            h->max / 1e3);
+  }
+  for (i = 0; i < PROF_STAGES; i++) {
+    struct profHist *h = &E.prof.hist[i];
+    if (h->count == 0) continue;
+    fprintf(fp, "\n%s\n", prof_names[i]);
+    for (b = 0; b < PROF_BUCKETS; b++) {
+      if (h->buckets[b] == 0) continue;
+      char lo[16], hi[16];
+      formatNs(lo, sizeof(lo), b ? 1LL << b : 0);
+      formatNs(hi, sizeof(hi), 1LL << (b + 1));
+      fprintf(fp, "  %8s - %-8s %10lld\n", lo, hi, h->buckets[b]);
+    }
+  }
+  return fclose(fp);
+}
+
+/*** memory ***/
+
+const char *mem_names[MEM_TAGS] = {"text",   "render", "hl",     "tree",
+                                   "file",   "undo",   "search", "screen",
+                                   "input",  "syntax", "columns", "overhead"};
+
+// every tracked block starts with its size and tag, so it can be counted
+// out again when it is freed
+struct memHeader {
+  size_t size;
+  size_t tag;
+};
+
+// *peak = max(*peak, v)
+void memRaise(long long *peak, long long v) {
+  long long cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (v > cur && !__atomic_compare_exchange_n(peak, &cur, v, 1,
+                                                 __ATOMIC_RELAXED,
+                                                 __ATOMIC_RELAXED))
+    ;
+}
+
+// the search worker allocates too, hence the atomics
+void memCount(int tag, long long bytes, int blocks) {
+  struct memStats *m = &E.mem[tag];
+  long long live = __atomic_add_fetch(&m->live, bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&m->blocks, blocks, __ATOMIC_RELAXED);
+  memRaise(&m->peak, live);
+  long long total = __atomic_add_fetch(&E.mem_live, bytes, __ATOMIC_RELAXED);
+  memRaise(&E.mem_peak, total);
+}
+
+// what a block costs beyond the bytes asked for: its header and whatever
+// malloc rounded the request up to
+long long memOverhead(struct memHeader *h) {
+  return (long long)malloc_usable_size(h) - (long long)h->size;
+}
+
+// realloc that counts the block against tag; p must be NULL or come from
+// memAlloc or memRealloc with the same tag
+void *memRealloc(int tag, void *p, size_t size) {
+  struct memHeader *h = p ? (struct memHeader *)p - 1 : NULL;
+  long long old = h ? (long long)h->size : 0;
+  long long oldover = h ? memOverhead(h) : 0;
+  h = realloc(h, sizeof(struct memHeader) + size);
+  if (h == NULL) die("realloc");
+  h->size = size;
+  h->tag = tag;
+  memCount(tag, (long long)size - old, p ? 0 : 1);
+  memCount(MEM_OVERHEAD, memOverhead(h) - oldover, 0);
+  return h + 1;
+}
+
+void *memAlloc(int tag, size_t size) { return memRealloc(tag, NULL, size); }
+
+void *memCalloc(int tag, size_t size) {
+  void *p = memAlloc(tag, size);
+  memset(p, 0, size);
+  return p;
+}
+
+void memFree(void *p) {
+  if (p == NULL) return;
+  struct memHeader *h = (struct memHeader *)p - 1;
+  memCount(h->tag, -(long long)h->size, -1);
+  memCount(MEM_OVERHEAD, -memOverhead(h), 0);
+  free(h);
+}
+
+char *memStrdup(int tag, const char *s) {
+  size_t len = strlen(s);
+  char *p = memAlloc(tag, len + 1);
+  memcpy(p, s, len + 1);
+  return p;
+}
+
+// peaks from now on
+void memResetPeak() {
+  int i;
+  for (i = 0; i < MEM_TAGS; i++) E.mem[i].peak = E.mem[i].live;
+  E.mem_peak = E.mem_live;
+}
+
+// 812 -> "812B", 45210000 -> "43.1M"
+void formatBytes(char *buf, int size, long long n) {
+  if (n < 1024)
+    snprintf(buf, size, "%lldB", n);
+  else if (n < 1024 * 1024)
+    snprintf(buf, size, "%.3gK", n / 1024.0);
+  else if (n < 1024LL * 1024 * 1024)
+    snprintf(buf, size, "%.3gM", n / (1024.0 * 1024));
+  else
+    snprintf(buf, size, "%.3gG", n / (1024.0 * 1024 * 1024));
+}
+
+// "43.1M live, 60.2M peak: text 30.1M render 2.04M ... | 100M mapped"
+void memSummary(char *buf, int size) {
+  char live[16], peak[16], n[16];
+  formatBytes(live, sizeof(live), E.mem_live);
+  formatBytes(peak, sizeof(peak), E.mem_peak);
+  int i, len = snprintf(buf, size, "%s live, %s peak:", live, peak);
+  for (i = 0; i < MEM_TAGS && len < size; i++) {
+    if (E.mem[i].live == 0) continue;
+    formatBytes(n, sizeof(n), E.mem[i].live);
+    len += snprintf(&buf[len], size - len, " %s %s", mem_names[i], n);
+  }
+  if (E.origmapped && len < size) {
+    formatBytes(n, sizeof(n), E.origlen);
+    snprintf(&buf[len], size - len, " | %s mapped", n);
+  }
+}
+
+/*** slab ***/
+
+// size classes, 16 bytes apart up to 256 and about 1.5x apart above; a
+// block that grows within its class is not moved, so typing into a row
+// rarely has to copy it
+const int slab_sizes[SLAB_CLASSES] = {
+    16,  32,  48,  64,  80,  96,   112,  128,  144,  160,  176,  192,
+    208, 224, 240, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096};
+
+// smallest class that holds size bytes, or -1
+int slabClass(size_t size) {
+  if (size <= 256) return size ? (size + 15) / 16 - 1 : 0;
+  int c;
+  for (c = 16; c < SLAB_CLASSES; c++)
+    if ((size_t)slab_sizes[c] >= size) return c;
+  return -1;
+}
+
+// blocks are carved out of arenas counted under MEM_OVERHEAD, so their
+// bytes move from there to tag and back
+void slabCount(int tag, int bytes, int blocks) {
+  E.slab.live[tag] += bytes;
+  E.slab.blocks[tag] += blocks;
+  memCount(tag, bytes, blocks);
+  memCount(MEM_OVERHEAD, -bytes, 0);
+}
+
+// row text and tree nodes are carved out of MICRO_SLAB_ARENA sized
+// arenas, so opening and editing a file takes few trips to malloc, and
+// slabRelease drops them all at once. Only the main thread may use these
+void *slabAlloc(int tag, size_t size) {
+  struct editorSlab *s = &E.slab;
+  int c = slabClass(size);
+  if (c < 0) {
+    struct slabBig *b = memAlloc(tag, sizeof(struct slabBig) + size);
+    b->prev = NULL;
+    b->next = s->big;
+    if (s->big) s->big->prev = b;
+    s->big = b;
+    return b + 1;
+  }
+
+  void *p;
+  if (s->free[c]) {
+    p = s->free[c];
+    s->free[c] = s->free[c]->next;
+  } else {
+    size_t n = slab_sizes[c];
+    if (s->left < n) {
+      // the first 16 bytes link the arenas and keep blocks aligned
+      char *a = memAlloc(MEM_OVERHEAD, MICRO_SLAB_ARENA);
+      *(char **)a = s->arenas;
+      s->arenas = a;
+      s->cur = a + 16;
+      s->left = MICRO_SLAB_ARENA - 16;
+    }
+    p = s->cur;
+    s->cur += n;
+    s->left -= n;
+  }
+  slabCount(tag, slab_sizes[c], 1);
+  return p;
+}
+
+// size must be what the block was last allocated or resized to
+void slabFree(int tag, void *p, size_t size) {
+  if (p == NULL) return;
+  struct editorSlab *s = &E.slab;
+  int c = slabClass(size);
+  if (c < 0) {
+    struct slabBig *b = (struct slabBig *)p - 1;
+    if (b->prev)
+      b->prev->next = b->next;
+    else
+      s->big = b->next;
+    if (b->next) b->next->prev = b->prev;
+    memFree(b);
+    return;
+  }
+  struct slabBlock *f = p;
+  f->next = s->free[c];
+  s->free[c] = f;
+  slabCount(tag, -slab_sizes[c], -1);
+}
+
+void *slabRealloc(int tag, void *p, size_t old, size_t size) {
+  if (p == NULL) return slabAlloc(tag, size);
+  int from = slabClass(old), to = slabClass(size);
+  if (from == to && from >= 0) return p;
+  if (from < 0 && to < 0) {
+    // let realloc grow or shrink a big block where it lies, which for the
+    // huge ones malloc maps is mremap rather than a copy
+    struct editorSlab *s = &E.slab;
+    struct slabBig *b = (struct slabBig *)p - 1;
+    b = memRealloc(tag, b, sizeof(struct slabBig) + size);
+    if (b->prev)
+      b->prev->next = b;
+    else
+      s->big = b;
+    if (b->next) b->next->prev = b;
+    return b + 1;
+  }
+  void *q = slabAlloc(tag, size);
+  memcpy(q, p, old < size ? old : size);
+  slabFree(tag, p, old);
+  return q;
+}
+
+// free every slab block at once
+void slabRelease() {
+  struct editorSlab *s = &E.slab;
+  while (s->arenas) {
+    char *next = *(char **)s->arenas;
+    memFree(s->arenas);
+    s->arenas = next;
+  }
+  while (s->big) {
+    struct slabBig *next = s->big->next;
+    memFree(s->big);
+    s->big = next;
+  }
+  int i;
+  for (i = 0; i < MEM_TAGS; i++) {
+    memCount(i, -s->live[i], -(int)s->blocks[i]);
+    memCount(MEM_OVERHEAD, s->live[i], 0);
+  }
+  memset(s, 0, sizeof(*s));
+}
 
 /*** terminal ***/
 void die(const char *s) {
-  // clear screen
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  // reposition cursor
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  if (!E.headless) {
+    // clear screen
+    write(STDOUT_FILENO, "\x1b[2J", 4);
+    // reposition cursor
+    write(STDOUT_FILENO, "\x1b[H", 3);
+  }
 
   perror(s);
   exit(1);
 }
 
 void disableRawMode() {
+  // turn bracketed paste back off
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
     die("tcsetattr");
   }
@@ -162,78 +1123,160 @@ void enableRawMode() {
   // CS8 - set character size to 8 bits per byte
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  // reads never block; waiting is done in editorPoll
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+  // bracketed paste: the terminal wraps pasted text in \x1b[200~ and
+  // \x1b[201~, see editorReadPaste
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-  // read keypress
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die("read");
-    }
-  }
-
-  if (c == '\x1b') {
-    char seq[3];
-
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1':
-              return HOME_KEY;
-            case '3':
-              return DEL_KEY;
-            case '4':
-              return END_KEY;
-            case '5':
-              return PAGE_UP;
-            case '6':
-              return PAGE_DOWN;
-            case '7':
-              return HOME_KEY;
-            case '8':
-              return END_KEY;
-          }
-        }
+// read whatever input is available in one go, waiting up to timeout
+// milliseconds for some; returns the number of bytes read
+int inputFill(int timeout) {
+  if (E.inpos > 0) {
+    memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen - E.inpos);
+    E.inlen -= E.inpos;
+    E.inpos = 0;
+  }
+  if (E.inlen == MICRO_INBUF) return 0;
+  long long t = nowNs();
+  int ready = editorPoll(timeout);
+  E.prof.fill += nowNs() - t;
+  if (!ready) return 0;
+  int nread = read(STDIN_FILENO, &E.inbuf[E.inlen], MICRO_INBUF - E.inlen);
+  if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+  if (nread <= 0) return 0;
+  E.inlen += nread;
+  return nread;
+}
+
+// the input byte i places past the decoder, or -1 if none came in time
+int inputPeek(int i) {
+  while (E.inpos + i >= E.inlen)
+    if (inputFill(MICRO_ESC_TIMEOUT_MS) == 0) return -1;
+  return (unsigned char)E.inbuf[E.inpos + i];
+}
+
+int inputMatch(const char *s) {
+  int i;
+  for (i = 0; s[i]; i++)
+    if (inputPeek(i) != (unsigned char)s[i]) return 0;
+  return 1;
+}
+
+void editorPasteAppend(const char *s, int len) {
+  if (E.pastelen + len > E.pastecap) {
+    E.pastecap = E.pastecap ? E.pastecap * 2 : 4096;
+    while (E.pastecap < E.pastelen + len) E.pastecap *= 2;
+    E.paste = memRealloc(MEM_INPUT, E.paste, E.pastecap);
+  }
+  memcpy(&E.paste[E.pastelen], s, len);
+  E.pastelen += len;
+}
+
+// collect pasted text up to the closing \x1b[201~, a buffer at a time; if
+// the terminal goes quiet first, the paste ends there
+int editorReadPaste() {
+  E.pastelen = 0;
+  while (1) {
+    if (E.inpos == E.inlen && inputFill(MICRO_ESC_TIMEOUT_MS) == 0) break;
+    char *p = &E.inbuf[E.inpos];
+    char *esc = memchr(p, '\x1b', E.inlen - E.inpos);
+    int len = esc ? esc - p : E.inlen - E.inpos;
+    editorPasteAppend(p, len);
+    E.inpos += len;
+    if (esc == NULL) continue;
+    if (inputMatch("\x1b[201~")) {
+      E.inpos += 6;
+      break;
+    }
+    editorPasteAppend("\x1b", 1);
+    E.inpos++;
+  }
+  return PASTE_KEY;
+}
+
+// input bytes waiting to be decoded, read or not
+int inputDepth() {
+  int queued = 0;
+  if (ioctl(STDIN_FILENO, FIONREAD, &queued) == -1) queued = 0;
+  return E.inlen - E.inpos + queued;
+}
+
+// decode one key from the input buffer, which holds at least one byte
+int editorDecodeKey() {
+  char c = E.inbuf[E.inpos++];
+  if (c != '\x1b') return c;
+
+  // decode escape sequences straight from the buffer; whatever does not
+  // parse is consumed and reported as a bare escape
+  int s0 = inputPeek(0);
+  int s1 = inputPeek(1);
+  if (s0 == -1 || s1 == -1) return '\x1b';
+  E.inpos += 2;
+
+  if (s0 == '[') {
+    // a CSI sequence: parameter bytes 0x30-0x3F, intermediate bytes
+    // 0x20-0x2F and one final byte 0x40-0x7E, all of it consumed, so keys
+    // with modifiers (ESC [1;5C) never leak into the text. Only the first
+    // parameter and the final byte pick the key
+    int t = s1, param = 0, first = 1;
+    while (t >= 0x20 && t <= 0x3f) {
+      if (first && t >= '0' && t <= '9') {
+        if (param < 1000) param = param * 10 + t - '0';
       } else {
-        switch (seq[1]) {
-          case 'A':
-            return ARROW_UP;
-          case 'B':
-            return ARROW_DOWN;
-          case 'C':
-            return ARROW_RIGHT;
-          case 'D':
-            return ARROW_LEFT;
-          case 'H':
+        first = 0;
+      }
+      t = inputPeek(0);
+      if (t == -1) return '\x1b';
+      if (t >= 0x20 && t <= 0x7e) E.inpos++;
+    }
+    switch (t) {
+      case 'A':
+        return ARROW_UP;
+      case 'B':
+        return ARROW_DOWN;
+      case 'C':
+        return ARROW_RIGHT;
+      case 'D':
+        return ARROW_LEFT;
+      case 'H':
+        return HOME_KEY;
+      case 'F':
+        return END_KEY;
+      case '~':
+        switch (param) {
+          case 1:
             return HOME_KEY;
-          case 'F':
+          case 3:
+            return DEL_KEY;
+          case 4:
             return END_KEY;
+          case 5:
+            return PAGE_UP;
+          case 6:
+            return PAGE_DOWN;
+          case 7:
+            return HOME_KEY;
+          case 8:
+            return END_KEY;
+          case 200:
+            return editorReadPaste();
         }
-      }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H':
-          return HOME_KEY;
-        case 'F':
-          return END_KEY;
-      }
     }
-
-    return '\x1b';
-  } else {
-    return c;
+  } else if (s0 == 'O') {
+    switch (s1) {
+      case 'H':
+        return HOME_KEY;
+      case 'F':
+        return END_KEY;
+    }
   }
+
+  return '\x1b';
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -245,16 +1288,19 @@ int getCursorPosition(int *rows, int *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) {
     return -1;
   }
-  // read response
+  // read response; reads do not block in raw mode, so it is waited for
+  // like the rest of an escape sequence
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) {
+    int c = inputPeek(i);
+    if (c == -1) {
       break;
     }
-    if (buf[i] == 'R') {
+    buf[i++] = c;
+    if (c == 'R') {
       break;
     }
-    i++;
   }
+  E.inpos += i;
   // null-terminate response
   buf[i] = '\0';
 
@@ -286,79 +1332,685 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** syntax highlighting ***/
-int is_separator(int c) {
-  // isspace - checks for white-space characters
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+int editorReadKey() {
+  while (E.inpos == E.inlen) inputFill(-1);
+  E.frame_keys++;
+  // the decoder may wait for the rest of an escape sequence; only the
+  // decoding itself is timed
+  long long t = nowNs();
+  long long fill = E.prof.fill;
+  int c = editorDecodeKey();
+  profAdd(PROF_KEY, nowNs() - t - (E.prof.fill - fill));
+  return c;
 }
 
-void editorUpdateSyntax(erow *row) {
-  // realloc - reallocates the given area of memory
-  row->hl = realloc(row->hl, row->rsize);
-  // memset - fills the first n bytes of the memory area pointed to by s with
-  // the constant byte c
-  memset(row->hl, HL_NORMAL, row->rsize);
+/*** row tree ***/
 
-  // if no syntax, return
-  if (E.syntax == NULL) {
+int rowTreeCount(rownode *n) { return n ? n->count : 0; }
+
+long long rowTreeBytes(rownode *n) { return n ? n->bytes : 0; }
+
+void rowTreeUpdate(rownode *n) {
+  n->count = n->nlines + rowTreeCount(n->left) + rowTreeCount(n->right);
+  n->bytes = n->nbytes + rowTreeBytes(n->left) + rowTreeBytes(n->right);
+  if (n->left) n->left->parent = n;
+  if (n->right) n->right->parent = n;
+}
+
+rownode *rowTreeMerge(rownode *a, rownode *b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (a->prio > b->prio) {
+    a->right = rowTreeMerge(a->right, b);
+    rowTreeUpdate(a);
+    return a;
+  }
+  b->left = rowTreeMerge(a, b->left);
+  rowTreeUpdate(b);
+  return b;
+}
+
+// split t so that the first k rows end up in *a and the rest in *b; k must
+// not fall inside a span
+void rowTreeSplit(rownode *t, int k, rownode **a, rownode **b) {
+  if (!t) {
+    *a = *b = NULL;
     return;
   }
-  // pointers to syntax keywords
-  char **keywords = E.syntax->keywords;
+  if (rowTreeCount(t->left) < k) {
+    rowTreeSplit(t->right, k - rowTreeCount(t->left) - t->nlines, &t->right,
+                 b);
+    rowTreeUpdate(t);
+    *a = t;
+  } else {
+    rowTreeSplit(t->left, k, a, &t->left);
+    rowTreeUpdate(t);
+    *b = t;
+  }
+}
 
-  char *scs = E.syntax->singleline_comment_start;
-  char *mcs = E.syntax->multiline_comment_start;
-  char *mce = E.syntax->multiline_comment_end;
+// build a balanced tree from n nodes in order, in O(n)
+rownode *rowTreeBuild(rownode **nodes, int n) {
+  if (n == 0) return NULL;
+  int mid = n / 2;
+  rownode *t = nodes[mid];
+  t->left = rowTreeBuild(nodes, mid);
+  t->right = rowTreeBuild(nodes + mid + 1, n - mid - 1);
+  rowTreeUpdate(t);
+
+  // priorities carry no meaning of their own, so restore the heap order by
+  // sifting the value down instead of rotating nodes
+  rownode *p = t;
+  while (1) {
+    rownode *c = p->left;
+    if (p->right && (!c || p->right->prio > c->prio)) c = p->right;
+    if (!c || c->prio <= p->prio) break;
+    unsigned int prio = p->prio;
+    p->prio = c->prio;
+    c->prio = prio;
+    p = c;
+  }
+  return t;
+}
 
-  int scs_len = scs ? strlen(scs) : 0;
-  int mcs_len = mcs ? strlen(mcs) : 0;
-  int mce_len = mce ? strlen(mce) : 0;
+void rowTreeSetRoot(rownode *root) {
+  E.rows = root;
+  if (root) root->parent = NULL;
+  E.numrows = rowTreeCount(root);
+}
 
-  int prev_sep = 1;
-  int in_string = 0;
-  int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// find the node holding row at; *off is set to the row's offset in the node
+rownode *rowTreeFind(int at, int *off) {
+  rownode *n = E.rows;
+  while (n) {
+    int left = rowTreeCount(n->left);
+    if (at < left) {
+      n = n->left;
+    } else if (at < left + n->nlines) {
+      *off = at - left;
+      return n;
+    } else {
+      at -= left + n->nlines;
+      n = n->right;
+    }
+  }
+  return NULL;
+}
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+int editorRowIndex(erow *row) {
+  rownode *n = (rownode *)row;
+  int idx = rowTreeCount(n->left);
+  while (n->parent) {
+    if (n->parent->right == n)
+      idx += rowTreeCount(n->parent->left) + n->parent->nlines;
+    n = n->parent;
+  }
+  return idx;
+}
 
-    if (scs_len && !in_string && !in_comment) {
-      if (!strncmp(&row->render[i], scs, scs_len)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+// offset of the row in the saved file
+long long editorRowOffset(erow *row) {
+  rownode *n = (rownode *)row;
+  long long off = rowTreeBytes(n->left);
+  while (n->parent) {
+    if (n->parent->right == n)
+      off += rowTreeBytes(n->parent->left) + n->parent->nbytes;
+    n = n->parent;
+  }
+  return off;
+}
 
-    if (mcs_len && mce_len && !in_string) {
-      if (in_comment) {
-        row->hl[i] = HL_MLCOMMENT;
-        if (!strncmp(&row->render[i], mce, mce_len)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-          i += mce_len;
-          in_comment = 0;
-          prev_sep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-        i += mcs_len;
-        in_comment = 1;
-        continue;
-      }
+// the node's size changed: set it and fix the sums above it
+void rowTreeSetBytes(rownode *n, long long nbytes) {
+  n->nbytes = nbytes;
+  for (; n; n = n->parent)
+    n->bytes = n->nbytes + rowTreeBytes(n->left) + rowTreeBytes(n->right);
+}
+
+// bytes that the raw lines from s to end take once saved: carriage returns
+// at line ends are dropped and the last line gets a newline
+long long editorSpanBytes(const char *s, const char *end) {
+  if (s == end) return 0;
+  long long bytes = (end - s) + (end[-1] != '\n');
+  if (memchr(s, '\r', end - s) == NULL) return bytes;
+  while (s < end) {
+    const char *nl = memchr(s, '\n', end - s);
+    const char *eol = nl ? nl : end;
+    while (eol > s && eol[-1] == '\r') {
+      eol--;
+      bytes--;
     }
+    s = nl ? nl + 1 : end;
+  }
+  return bytes;
+}
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (in_string) {
-        row->hl[i] = HL_STRING;
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
+// the row holding byte off of the saved file, and in *col the byte's
+// column in it. Past the end of the file this is the line after the last
+int editorRowAtOffset(long long off, int *col) {
+  *col = 0;
+  if (off >= rowTreeBytes(E.rows)) return E.numrows;
+  rownode *n = E.rows;
+  int at = 0;
+  while (1) {
+    long long left = rowTreeBytes(n->left);
+    if (off < left) {
+      n = n->left;
+    } else if (off < left + n->nbytes) {
+      off -= left;
+      at += rowTreeCount(n->left);
+      break;
+    } else {
+      off -= left + n->nbytes;
+      at += rowTreeCount(n->left) + n->nlines;
+      n = n->right;
+    }
+  }
+  if (n->row.flags & ROW_SPAN) {
+    // walk the lines of the span, the way editorSpanBytes counts them
+    const char *s = n->row.chars;
+    const char *end = s + n->row.size;
+    while (1) {
+      const char *nl = memchr(s, '\n', end - s);
+      const char *eol = nl ? nl : end;
+      while (eol > s && eol[-1] == '\r') eol--;
+      if (off <= eol - s) break;
+      off -= eol - s + 1;
+      at++;
+      s = nl + 1;
+    }
+  }
+  *col = off;
+  return at;
+}
+
+// first node in order, span or not; iterate with editorRowNext
+erow *editorRowFirst() {
+  rownode *n = E.rows;
+  if (!n) return NULL;
+  while (n->left) n = n->left;
+  return &n->row;
+}
+
+erow *editorRowNext(erow *row) {
+  rownode *n = (rownode *)row;
+  if (n->right) {
+    n = n->right;
+    while (n->left) n = n->left;
+    return &n->row;
+  }
+  while (n->parent && n->parent->right == n) n = n->parent;
+  return n->parent ? &n->parent->row : NULL;
+}
+
+erow *editorRowPrev(erow *row) {
+  rownode *n = (rownode *)row;
+  if (n->left) {
+    n = n->left;
+    while (n->right) n = n->right;
+    return &n->row;
+  }
+  while (n->parent && n->parent->left == n) n = n->parent;
+  return n->parent ? &n->parent->row : NULL;
+}
+
+/*** syntax highlighting ***/
+int is_separator(int c) {
+  // isspace - checks for white-space characters
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// FNV-1a
+unsigned int editorKeywordHash(const char *s, int len) {
+  unsigned int h = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// build the keyword hash of syn; keywords ending in '|' are HL_KEYWORD2
+void editorSyntaxCompile(struct editorSyntax *syn) {
+  if (syn->kwtable) return;
+
+  // built-in syntaxes split tokens and quote strings the C way
+  int c;
+  for (c = 0; c < 256; c++)
+    syn->cls[c] = (is_separator(c) ? SYN_SEP : 0) |
+                  (c == '"' || c == '\'' ? SYN_QUOTE : 0);
+
+  int n = 0;
+  while (syn->keywords[n]) n++;
+  unsigned int size = 8;
+  while (size < (unsigned int)n * 2) size <<= 1;
+  syn->kwtable = memCalloc(MEM_SYNTAX, size * sizeof(struct editorKeyword));
+  syn->kwmask = size - 1;
+
+  int j;
+  for (j = 0; j < n; j++) {
+    const char *word = syn->keywords[j];
+    int len = strlen(word);
+    int hl = HL_KEYWORD1;
+    if (len > 0 && word[len - 1] == '|') {
+      len--;
+      hl = HL_KEYWORD2;
+    }
+    if (len == 0) continue;
+    if (len > syn->kwmax) syn->kwmax = len;
+
+    // linear probing; the first definition of a word wins
+    unsigned int h = editorKeywordHash(word, len) & syn->kwmask;
+    while (syn->kwtable[h].word &&
+           !(syn->kwtable[h].len == len &&
+             !memcmp(syn->kwtable[h].word, word, len)))
+      h = (h + 1) & syn->kwmask;
+    if (syn->kwtable[h].word) continue;
+    syn->kwtable[h].word = word;
+    syn->kwtable[h].len = len;
+    syn->kwtable[h].hl = hl;
+  }
+}
+
+// return the keyword class of the token s[0..len), or HL_NORMAL
+int editorKeywordLookup(struct editorSyntax *syn, const char *s, int len) {
+  unsigned int h = editorKeywordHash(s, len) & syn->kwmask;
+  while (syn->kwtable[h].word) {
+    if (syn->kwtable[h].len == len && !memcmp(syn->kwtable[h].word, s, len))
+      return syn->kwtable[h].hl;
+    h = (h + 1) & syn->kwmask;
+  }
+  return HL_NORMAL;
+}
+
+// run the comment/string part of editorHighlightRow over one line of raw
+// text and return whether a multiline comment is still open at its end
+int editorSyntaxLexLine(const char *s, int len, int in_comment) {
+  if (E.syntax == NULL) return 0;
+
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int in_string = 0;
+  int i = 0;
+  while (i < len) {
+    char c = s[i];
+
+    if (scs_len && !in_string && !in_comment) {
+      if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len)) break;
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) {
+          i += mce_len;
+          in_comment = 0;
+        } else {
+          i++;
+        }
+        continue;
+      } else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        if (c == '\\' && i + 1 < len) {
+          i += 2;
+          continue;
+        }
+        if (c == in_string) in_string = 0;
+      } else if (E.syntax->cls[(unsigned char)c] & SYN_QUOTE) {
+        in_string = c;
+      }
+    }
+    i++;
+  }
+  return in_comment;
+}
+
+// lex the first nlines lines of raw text starting at s
+int editorSyntaxLexLines(const char *s, const char *end, int nlines,
+                         int in_comment) {
+  if (E.syntax == NULL) return 0;
+  while (nlines-- > 0 && s < end) {
+    const char *nl = memchr(s, '\n', end - s);
+    const char *eol = nl ? nl : end;
+    int len = eol - s;
+    while (len > 0 && s[len - 1] == '\r') len--;
+    in_comment = editorSyntaxLexLine(s, len, in_comment);
+    s = eol + 1;
+  }
+  return in_comment;
+}
+
+// rows at and after from may now carry a wrong end state and rows up to to
+// changed; the lexing itself is left to editorSyntaxSettle
+void editorSyntaxInvalidate(int from, int to) {
+  E.lex.edited = 1;
+  if (from < E.hl_from) E.hl_from = from;
+  if (to > E.hl_to) E.hl_to = to;
+}
+
+// end state of a row or span lexed from in_comment
+int editorSyntaxLexNode(rownode *node, int in_comment) {
+  erow *row = &node->row;
+  if (row->flags & ROW_SPAN)
+    return editorSyntaxLexLines(row->chars, row->chars + row->size,
+                                node->nlines, in_comment);
+  if (row->win) return editorSyntaxLexLong(row, in_comment);
+  return editorSyntaxLexLine(row->chars, row->size, in_comment);
+}
+
+// lex spans [from, to) starting from in_comment, up to the first one whose
+// end state comes out unchanged; false if asked to stop first
+int editorSyntaxLexRun(int from, int to, int in_comment, int relex) {
+  struct editorLex *lx = &E.lex;
+  int i;
+  for (i = from; i < to; i++) {
+    if (__atomic_load_n(&lx->cancel, __ATOMIC_RELAXED)) return 0;
+    struct lexSpan *sp = &lx->spans[i];
+    int out = editorSyntaxLexLines(sp->s, sp->s + sp->size, sp->nlines,
+                                   in_comment);
+    if (relex && out == sp->out) break;
+    sp->out = in_comment = out;
+  }
+  return 1;
+}
+
+// lex the spans of a chunk as if it started outside a comment. Only the
+// first chunk really does; whichever thread finishes last lexes the
+// others again from their true start state, up to where the end states
+// agree again, and tells the main thread
+void *editorSyntaxLexChunk(void *arg) {
+  struct editorLex *lx = &E.lex;
+  struct lexChunk *c = arg;
+  if (!editorSyntaxLexRun(c->from, c->to, 0, 0)) return NULL;
+  if (__atomic_add_fetch(&lx->done, 1, __ATOMIC_ACQ_REL) < lx->nchunks)
+    return NULL;
+
+  int i;
+  for (i = 1; i < lx->nchunks; i++) {
+    struct lexChunk *prev = &lx->chunks[i - 1];
+    int in_comment = lx->spans[prev->to - 1].out;
+    if (in_comment &&
+        !editorSyntaxLexRun(lx->chunks[i].from, lx->chunks[i].to, in_comment,
+                            1))
+      return NULL;
+  }
+  __atomic_store_n(&lx->finished, 1, __ATOMIC_RELEASE);
+  write(lx->notify[1], "", 1);
+  return NULL;
+}
+
+// lex the spans of a freshly opened file on E.lex_threads threads in the
+// background, while the screen is settled as usual; editorSyntaxLexNotify
+// takes the states in once they are all done. Returns 0 (leaving it all
+// to editorSyntaxSettle) when there is no point in threads
+int editorSyntaxLexStart(rownode **spans, int nspans) {
+  struct editorLex *lx = &E.lex;
+  if (E.syntax == NULL) return 0;
+  int nchunks = E.lex_threads;
+  if (nchunks > nspans) nchunks = nspans;
+  if (nchunks < 2) return 0;
+
+  lx->spans = memAlloc(MEM_SYNTAX, sizeof(struct lexSpan) * nspans);
+  lx->nspans = nspans;
+  int i, line = 0;
+  for (i = 0; i < nspans; i++) {
+    struct lexSpan *sp = &lx->spans[i];
+    sp->s = spans[i]->row.chars;
+    sp->size = spans[i]->row.size;
+    sp->nlines = spans[i]->nlines;
+    line += sp->nlines;
+    sp->end = line;
+    sp->out = 0;
+  }
+
+  lx->running = 1;
+  lx->cancel = 0;
+  lx->done = 0;
+  lx->finished = 0;
+  lx->edited = 0;
+  lx->nchunks = nchunks;
+  int c;
+  for (c = 0; c < nchunks; c++) {
+    lx->chunks[c].from = (long long)nspans * c / nchunks;
+    lx->chunks[c].to = (long long)nspans * (c + 1) / nchunks;
+    if (pthread_create(&lx->chunks[c].thread, NULL, editorSyntaxLexChunk,
+                       &lx->chunks[c]) != 0)
+      die("pthread_create");
+  }
+  return 1;
+}
+
+// wait for the lex threads (asking them to stop first if cancel) and drop
+// their spans
+void editorSyntaxLexJoin(int cancel) {
+  struct editorLex *lx = &E.lex;
+  if (!lx->running) return;
+  if (cancel) __atomic_store_n(&lx->cancel, 1, __ATOMIC_RELAXED);
+  int c;
+  for (c = 0; c < lx->nchunks; c++) pthread_join(lx->chunks[c].thread, NULL);
+  editorDrain(lx->notify[0]);
+  memFree(lx->spans);
+  lx->spans = NULL;
+  lx->nspans = 0;
+  lx->running = 0;
+}
+
+// stop a lex still running, for when the text or the syntax goes away
+void editorSyntaxLexStop() { editorSyntaxLexJoin(1); }
+
+// the lex threads are done: store the states they found from E.hl_from on,
+// where the screen has not been settled yet. Rows and spans cut out of
+// the spans since are lexed from the state before them. Edits in the
+// meantime leave it all to editorSyntaxSettle
+void editorSyntaxLexNotify(int fd) {
+  struct editorLex *lx = &E.lex;
+  editorDrain(fd);
+  if (!lx->running || !__atomic_load_n(&lx->finished, __ATOMIC_ACQUIRE))
+    return;
+  struct lexSpan *spans = lx->spans;
+  lx->spans = NULL;
+  editorSyntaxLexJoin(0);
+
+  if (!lx->edited && E.hl_from < E.numrows) {
+    int off;
+    rownode *n = rowTreeFind(E.hl_from, &off);
+    int at = E.hl_from - off;
+    erow *row = &n->row;
+    erow *prev = editorRowPrev(row);
+    int in_comment = prev ? prev->hl_open_comment : 0;
+    int j = 0;
+    while (row) {
+      rownode *node = (rownode *)row;
+      at += node->nlines;
+      while (spans[j].end < at) j++;
+      int out = spans[j].end == at ? spans[j].out
+                                   : editorSyntaxLexNode(node, in_comment);
+      erow *next = editorRowNext(row);
+      if (out != row->hl_open_comment && next) next->flags |= ROW_HL_DIRTY;
+      row->hl_open_comment = in_comment = out;
+      row = next;
+    }
+    E.hl_from = INT_MAX;
+    E.hl_to = -1;
+  }
+  memFree(spans);
+}
+
+// relex rows forward from E.hl_from, iteratively, until the stored end
+// states match again or row upto has been passed. Rows further down are
+// left for later calls; deadline (if not NULL) bounds the time spent.
+// Returns whether work is left
+int editorSyntaxSettle(int upto, const struct timespec *deadline) {
+  if (E.hl_from >= E.numrows) {
+    E.hl_from = INT_MAX;
+    E.hl_to = -1;
+    return 0;
+  }
+
+  int off;
+  rownode *n = rowTreeFind(E.hl_from, &off);
+  int at = E.hl_from - off;
+  erow *row = &n->row;
+  erow *prev = editorRowPrev(row);
+  int in_comment = prev ? prev->hl_open_comment : 0;
+
+  while (row && at <= upto) {
+    rownode *node = (rownode *)row;
+    int out = editorSyntaxLexNode(node, in_comment);
+
+    // past the last edit, an unchanged end state means everything below
+    // was lexed from the same state and is still right
+    if (out == row->hl_open_comment && at >= E.hl_to) {
+      E.hl_from = INT_MAX;
+      E.hl_to = -1;
+      return 0;
+    }
+
+    erow *next = editorRowNext(row);
+    if (out != row->hl_open_comment && next) next->flags |= ROW_HL_DIRTY;
+    row->hl_open_comment = out;
+    in_comment = out;
+    at += node->nlines;
+    row = next;
+
+    if (deadline) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > deadline->tv_sec ||
+          (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+        break;
+    }
+  }
+
+  if (row == NULL) {
+    E.hl_from = INT_MAX;
+    E.hl_to = -1;
+    return 0;
+  }
+  // the row we stopped at has not been checked yet; keep it inside the
+  // edited range, so an edit further up cannot converge before reaching it
+  E.hl_from = at;
+  if (E.hl_to < at) E.hl_to = at;
+  return 1;
+}
+
+// how far past a byte the highlighter may read to decide about it
+int editorSyntaxReach() {
+  if (E.syntax == NULL) return 0;
+  int reach = E.syntax->kwmax;
+  char *delims[] = {E.syntax->singleline_comment_start,
+                    E.syntax->multiline_comment_start,
+                    E.syntax->multiline_comment_end};
+  unsigned int j;
+  for (j = 0; j < sizeof(delims) / sizeof(delims[0]); j++) {
+    int len = delims[j] ? (int)strlen(delims[j]) : 0;
+    if (len > reach) reach = len;
+  }
+  // a backslash in a string takes the next character along
+  return reach > 2 ? reach : 2;
+}
+
+// state at the start of row, which carries on from the row before it
+void editorHighlightStart(erow *row, struct hlState *st) {
+  erow *prev = editorRowPrev(row);
+  st->pos = 0;
+  st->in_comment = (prev && prev->hl_open_comment);
+  st->in_string = 0;
+  st->prev_sep = 1;
+  st->prev_hl = HL_NORMAL;
+}
+
+// set hl of s[from, from + n) to h, as far as it lies in [base, stop)
+void editorHighlightFill(unsigned char *hl, int base, int stop, int from,
+                         int n, int h) {
+  if (hl == NULL) return;
+  int to = from + n;
+  if (from < base) from = base;
+  if (to > stop) to = stop;
+  if (from < to) memset(&hl[from - base], h, to - from);
+}
+
+// highlight s[st->pos, len) until a position at or past stop, and leave st
+// there. hl, if not NULL, receives the classes of s[base, stop)
+void editorHighlightRun(const char *s, int len, struct hlState *st, int stop,
+                        unsigned char *hl, int base) {
+  char *scs = E.syntax->singleline_comment_start;
+  char *mcs = E.syntax->multiline_comment_start;
+  char *mce = E.syntax->multiline_comment_end;
+  const unsigned char *cls = E.syntax->cls;
+
+  int scs_len = scs ? strlen(scs) : 0;
+  int mcs_len = mcs ? strlen(mcs) : 0;
+  int mce_len = mce ? strlen(mce) : 0;
+
+  int i = st->pos;
+  int in_comment = st->in_comment;
+  int in_string = st->in_string;
+  int prev_sep = st->prev_sep;
+  int prev_hl = st->prev_hl;
+
+#define HL_SET(at, n, h) \
+  editorHighlightFill(hl, base, stop, (at), (n), prev_hl = (h))
+
+  if (in_comment == 2) {
+    HL_SET(i, len - i, HL_COMMENT);
+    i = len;
+  }
+
+  while (i < len && i < stop) {
+    char c = s[i];
+
+    if (scs_len && !in_string && !in_comment) {
+      if (i + scs_len <= len && !memcmp(&s[i], scs, scs_len)) {
+        HL_SET(i, len - i, HL_COMMENT);
+        in_comment = 2;
+        i = len;
+        break;
+      }
+    }
+
+    if (mcs_len && mce_len && !in_string) {
+      if (in_comment) {
+        if (i + mce_len <= len && !memcmp(&s[i], mce, mce_len)) {
+          HL_SET(i, mce_len, HL_MLCOMMENT);
+          i += mce_len;
+          in_comment = 0;
+          prev_sep = 1;
+          continue;
+        } else {
+          HL_SET(i, 1, HL_MLCOMMENT);
+          i++;
+          continue;
+        }
+      } else if (i + mcs_len <= len && !memcmp(&s[i], mcs, mcs_len)) {
+        HL_SET(i, mcs_len, HL_MLCOMMENT);
+        i += mcs_len;
+        in_comment = 1;
+        continue;
+      }
+    }
+
+    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+      if (in_string) {
+        if (c == '\\' && i + 1 < len) {
+          HL_SET(i, 2, HL_STRING);
+          i += 2;
+          continue;
         }
+        HL_SET(i, 1, HL_STRING);
         if (c == in_string) {
           in_string = 0;
         }
@@ -366,9 +2018,9 @@ void editorUpdateSyntax(erow *row) {
         prev_sep = 1;
         continue;
       } else {
-        if (c == '"' || c == '\'') {
+        if (cls[(unsigned char)c] & SYN_QUOTE) {
           in_string = c;
-          row->hl[i] = HL_STRING;
+          HL_SET(i, 1, HL_STRING);
           i++;
           continue;
         }
@@ -378,7 +2030,7 @@ void editorUpdateSyntax(erow *row) {
     if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
       if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
           (c == '.' && prev_hl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
+        HL_SET(i, 1, HL_NUMBER);
         i++;
         prev_sep = 0;
         continue;
@@ -386,34 +2038,160 @@ void editorUpdateSyntax(erow *row) {
     }
 
     if (prev_sep) {
-      int j;
-      for (j = 0; keywords[j]; j++) {
-        int klen = strlen(keywords[j]);
-        int kw2 = keywords[j][klen - 1] == '|';
-        if (kw2) {
-          klen--;
-        }
-        if (!strncmp(&row->render[i], keywords[j], klen) &&
-            is_separator(row->render[i + klen])) {
-          memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-          i += klen;
-          break;
-        }
-      }
-      if (keywords[j] != NULL) {
+      // a keyword must make up the whole token, so measure the token once
+      // and look it up instead of trying every keyword
+      int klen = 0;
+      while (i + klen < len && !(cls[(unsigned char)s[i + klen]] & SYN_SEP))
+        klen++;
+      int kw = klen ? editorKeywordLookup(E.syntax, &s[i], klen) : HL_NORMAL;
+      if (kw != HL_NORMAL) {
+        HL_SET(i, klen, kw);
+        i += klen;
         prev_sep = 0;
         continue;
       }
     }
 
-    prev_sep = is_separator(c);
+    prev_hl = HL_NORMAL;
+    prev_sep = (cls[(unsigned char)c] & SYN_SEP) != 0;
     i++;
   }
+#undef HL_SET
+
+  st->pos = i;
+  st->in_comment = in_comment;
+  st->in_string = in_string;
+  st->prev_sep = prev_sep;
+  st->prev_hl = prev_hl;
+}
+
+// highlighter state at the last checkpoint of a long row at or before byte
+// at, building the checkpoints up to there first
+void editorRowHlState(erow *row, int at, struct hlState *st) {
+  struct rowWindow *w = row->win;
+  int k = at / MICRO_COL_STRIDE;
+  if (k >= w->nhls) {
+    int max = row->size / MICRO_COL_STRIDE;
+    w->hls = memRealloc(MEM_HL, w->hls, sizeof(struct hlState) * (max + 1));
+    struct hlState cur = w->hls[w->nhls - 1];
+    while (w->nhls <= k) {
+      editorHighlightRun(row->chars, row->size, &cur,
+                         w->nhls * MICRO_COL_STRIDE, NULL, 0);
+      w->hls[w->nhls++] = cur;
+    }
+  }
+  *st = w->hls[k];
+}
+
+// end state of a long row lexed from in_comment, carried on from its last
+// checkpoint rather than from the start. Once past the mark of the last
+// edit, a state that agrees with the one there before means the end state
+// cannot have changed either
+int editorSyntaxLexLong(erow *row, int in_comment) {
+  struct rowWindow *w = row->win;
+  int marked = w->marked;
+  w->marked = 0;
+  if (E.syntax == NULL || w->nhls == 0 || w->hls[0].in_comment != in_comment)
+    return editorSyntaxLexLine(row->chars, row->size, in_comment);
+
+  struct hlState st = w->hls[w->nhls - 1];
+  if (marked) {
+    struct hlState *m = &w->mark;
+    editorHighlightRun(row->chars, row->size, &st, m->pos, NULL, 0);
+    if (st.pos == m->pos && st.in_comment == m->in_comment &&
+        st.in_string == m->in_string && st.prev_sep == m->prev_sep &&
+        st.prev_hl == m->prev_hl)
+      return row->hl_open_comment;
+  }
+  editorHighlightRun(row->chars, row->size, &st, row->size, NULL, 0);
+  return st.in_comment == 1;
+}
+
+// highlight the rendered window of a long row into out: its bytes first,
+// starting from the nearest checkpoint, then spread over their columns
+void editorHighlightWindow(erow *row, unsigned char *out) {
+  struct rowWindow *w = row->win;
+  struct hlState st;
+  editorHighlightStart(row, &st);
+  if (w->nhls == 0 || w->hls[0].in_comment != st.in_comment) {
+    w->hls = memRealloc(MEM_HL, w->hls, sizeof(struct hlState));
+    w->hls[0] = st;
+    w->nhls = 1;
+  }
+
+  int n = w->to - w->from;
+  unsigned char *hl = memAlloc(MEM_HL, n + 1);
+  memset(hl, HL_NORMAL, n);
+  editorRowHlState(row, w->from, &st);
+  // a token or delimiter the checkpoint lies inside of is all one class
+  if (st.pos > w->from)
+    editorHighlightFill(hl, w->from, w->to, w->from, st.pos - w->from,
+                        st.prev_hl);
+  editorHighlightRun(row->chars, row->size, &st, w->to, hl, w->from);
+  // edits happen on screen, so have the checkpoints past it ready for the
+  // mark editorRowColsTrim takes
+  editorRowHlState(row, w->to, &st);
+
+  int rx = w->col;
+  int idx = 0;
+  int j;
+  for (j = w->from; j < w->to; j++) {
+    int end = rx + 1;
+    if (row->chars[j] == '\t')
+      end += (MICRO_TAB_STOP - 1) - (rx % MICRO_TAB_STOP);
+    while (rx < end) {
+      out[idx++] = hl[j - w->from];
+      rx++;
+    }
+  }
+  memFree(hl);
+}
+
+// store the classes of the n columns in hl as runs in row->hl
+void editorRowSetHl(erow *row, const unsigned char *hl, int n) {
+  int runs = 0;
+  int i = 0;
+  while (i < n) {
+    int len = 1;
+    while (len < 255 && i + len < n && hl[i + len] == hl[i]) len++;
+    i += len;
+    runs++;
+  }
+  row->hl = memRealloc(MEM_HL, row->hl, runs * 2);
+  row->hlruns = runs;
+
+  unsigned char *run = row->hl;
+  i = 0;
+  while (i < n) {
+    int len = 1;
+    while (len < 255 && i + len < n && hl[i + len] == hl[i]) len++;
+    *run++ = len;
+    *run++ = hl[i];
+    i += len;
+  }
+}
+
+void editorHighlightRow(erow *row) {
+  // one spare byte, so there is a buffer even for an empty row
+  if (E.hlcap <= row->rsize) {
+    E.hlcap = row->rsize + 1;
+    E.hlbuf = memRealloc(MEM_HL, E.hlbuf, E.hlcap);
+  }
+  unsigned char *hl = E.hlbuf;
+  // memset - fills the first n bytes of the memory area pointed to by s with
+  // the constant byte c
+  memset(hl, HL_NORMAL, row->rsize);
 
-  int changed = (row->hl_open_comment != in_comment);
-  row->hl_open_comment = in_comment;
-  if (changed && row->idx + 1 < E.numrows)
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+  if (E.syntax != NULL) {
+    if (row->win) {
+      editorHighlightWindow(row, hl);
+    } else {
+      struct hlState st;
+      editorHighlightStart(row, &st);
+      editorHighlightRun(row->render, row->rsize, &st, row->rsize, hl, 0);
+    }
+  }
+  editorRowSetHl(row, hl, row->rsize);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -436,66 +2214,746 @@ int editorSyntaxToColor(int hl) {
   }
 }
 
-void editorSelectSyntaxHighlight() {
-  // set syntax to NULL
-  E.syntax = NULL;
-  // if no filename, return
-  if (E.filename == NULL) {
-    return;
-  }
+/*** syntax files ***/
+
+// Syntax definitions are read from $MICRO_SYNTAX_DIR, or else from
+// ~/.config/micro/syntax: one NAME.syntax file per language, holding one
+// directive per line. Lines starting with '#' are comments.
+//   filetype NAME        name shown in the status bar
+//   match PATTERN...     ".ext" matches an extension, anything else a part
+//                        of the file name
+//   comment START        single-line comment
+//   multiline START END  multi-line comment
+//   strings QUOTES...    characters that quote strings
+//   numbers              highlight numbers
+//   separators CHARS     punctuation that ends a token, besides white space
+//   keywords WORD...     HL_KEYWORD1
+//   types WORD...        HL_KEYWORD2
+// All of them are compiled into one cache file, keyword hashes included,
+// which later runs map as it is until a syntax file changes.
+
+#define SYNTAX_CACHE_MAGIC 0x314e5953u
+
+struct syntaxCacheHeader {
+  unsigned int magic;
+  unsigned int count;
+  // nfiles - the syntax files the cache was built from; stamp - a hash of
+  // their names, sizes and mtimes and of the mtime of their directory
+  unsigned int nfiles;
+  unsigned int size;
+  unsigned long long stamp;
+};
 
-  // get file extension
-  char *ext = strrchr(E.filename, '.');
+// offsets are into the string pool that follows the entries; 0 is none
+struct syntaxCacheEntry {
+  unsigned int filetype;
+  // match - patterns one after another, up to an empty one
+  unsigned int match;
+  unsigned int scs;
+  unsigned int mcs;
+  unsigned int mce;
+  unsigned int flags;
+  // kwtable - kwmask + 1 slots, laid out like editorSyntax.kwtable
+  unsigned int kwtable;
+  unsigned int kwmask;
+  unsigned int kwmax;
+  unsigned char cls[256];
+};
 
-  // iterate through HLDB
-  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-    // get syntax
-    struct editorSyntax *s = &HLDB[j];
-    // iterate through filematch
-    unsigned int i = 0;
-    while (s->filematch[i]) {
-      // check if file extension matches
-      int is_ext = (s->filematch[i][0] == '.');
-      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-          (!is_ext && strstr(E.filename, s->filematch[i]))) {
-        // set syntax
-        E.syntax = s;
-        // iterate through rows
-        int filerow;
-        for (filerow = 0; filerow < E.numrows; filerow++) {
-          // update syntax
-          editorUpdateSyntax(&E.row[filerow]);
-        }
-        return;
-      }
-      i++;
+struct syntaxCacheKeyword {
+  unsigned int word;
+  unsigned int len;
+  unsigned int hl;
+};
+
+int editorSyntaxDir(char *buf, size_t size) {
+  char *dir = getenv("MICRO_SYNTAX_DIR");
+  char *home = getenv("HOME");
+  if (dir)
+    snprintf(buf, size, "%s", dir);
+  else if (home)
+    snprintf(buf, size, "%s/.config/micro/syntax", home);
+  else
+    return 0;
+  return 1;
+}
+
+// $XDG_CACHE_HOME/micro/syntax.cache or ~/.cache/micro/syntax.cache,
+// creating the directories on the way
+int editorSyntaxCachePath(char *buf, size_t size) {
+  char *xdg = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (xdg && *xdg)
+    snprintf(buf, size, "%s", xdg);
+  else if (home)
+    snprintf(buf, size, "%s/.cache", home);
+  else
+    return 0;
+  mkdir(buf, 0755);
+  size_t len = strlen(buf);
+  snprintf(&buf[len], size - len, "/micro");
+  mkdir(buf, 0755);
+  len = strlen(buf);
+  snprintf(&buf[len], size - len, "/syntax.cache");
+  return 1;
+}
+
+int editorSyntaxNameCmp(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// fold n bytes into the FNV-1a hash h
+unsigned long long editorSyntaxStamp(unsigned long long h, const void *p,
+                                     size_t n) {
+  const unsigned char *b = p;
+  while (n--) h = (h ^ *b++) * 0x100000001b3ULL;
+  return h;
+}
+
+// the *.syntax files of dir in name order, and a stamp that changes when
+// any of them or dir itself does (a file set back to an older mtime
+// included). Returns how many there are, or -1 without a directory
+int editorSyntaxScan(const char *dir, char ***names,
+                     unsigned long long *stamp) {
+  struct stat st;
+  DIR *d = opendir(dir);
+  if (d == NULL || fstat(dirfd(d), &st) == -1) {
+    if (d) closedir(d);
+    return -1;
+  }
+  long long dirtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+  int n = 0, cap = 0;
+  *names = NULL;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len <= 7 || strcmp(&de->d_name[len - 7], ".syntax")) continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 16;
+      *names = memRealloc(MEM_SYNTAX, *names, sizeof(char *) * cap);
     }
+    (*names)[n] = memAlloc(MEM_SYNTAX, len + 1);
+    memcpy((*names)[n++], de->d_name, len + 1);
   }
-}
+  if (n > 1) qsort(*names, n, sizeof(char *), editorSyntaxNameCmp);
 
-/*** row operations ***/
-int editorRowCxToRx(erow *row, int cx) {
-  // rx - render index
-  int rx = 0;
-  // iterate through row
-  int j;
-  for (j = 0; j < cx; j++) {
-    // if tab, increment rx by tab stop minus remainder of rx divided by tab
-    // stop
-    if (row->chars[j] == '\t') {
-      rx += (MICRO_TAB_STOP - 1) - (rx % MICRO_TAB_STOP);
+  // in name order, so the stamp does not depend on readdir's
+  *stamp = editorSyntaxStamp(0xcbf29ce484222325ULL, &dirtime, sizeof(dirtime));
+  int i;
+  for (i = 0; i < n; i++) {
+    long long f[2] = {-1, -1};
+    if (fstatat(dirfd(d), (*names)[i], &st, 0) == 0) {
+      f[0] = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+      f[1] = st.st_size;
     }
-    rx++;
+    *stamp = editorSyntaxStamp(*stamp, (*names)[i], strlen((*names)[i]) + 1);
+    *stamp = editorSyntaxStamp(*stamp, f, sizeof(f));
   }
-  return rx;
+  closedir(d);
+  return n;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-  // rx - render index
-  int cur_rx = 0;
+// a growing buffer the cache is put together in
+struct syntaxPool {
+  char *b;
+  size_t len;
+  size_t cap;
+};
+
+char *syntaxPoolReserve(struct syntaxPool *pool, size_t len) {
+  if (pool->len + len > pool->cap) {
+    while (pool->len + len > pool->cap)
+      pool->cap = pool->cap ? pool->cap * 2 : 4096;
+    pool->b = memRealloc(MEM_SYNTAX, pool->b, pool->cap);
+  }
+  char *p = &pool->b[pool->len];
+  pool->len += len;
+  return p;
+}
+
+void syntaxPoolAppend(struct syntaxPool *pool, const char *s, size_t len) {
+  memcpy(syntaxPoolReserve(pool, len), s, len);
+}
+
+// append s and a NUL; returns where it went
+unsigned int syntaxPoolString(struct syntaxPool *pool, const char *s) {
+  unsigned int off = pool->len;
+  syntaxPoolAppend(pool, s, strlen(s) + 1);
+  return off;
+}
+
+// compile the syntax file at path into e, appending its strings and its
+// keyword table to pool. Returns 0 if it names no filetype
+int editorSyntaxParse(const char *path, struct syntaxCacheEntry *e,
+                      struct syntaxPool *pool) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return 0;
+  memset(e, 0, sizeof(*e));
+
+  struct syntaxPool match = {NULL, 0, 0};
+  struct syntaxCacheKeyword *words = NULL;
+  int nwords = 0, wordcap = 0;
+  char seps[128] = ",.()+-/*=~%<>[];";
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, fp) != -1) {
+    char *key = strtok(line, " \t\r\n");
+    if (key == NULL || key[0] == '#') continue;
+    char *arg = strtok(NULL, " \t\r\n");
+
+    if (!strcmp(key, "filetype") && arg) {
+      e->filetype = syntaxPoolString(pool, arg);
+    } else if (!strcmp(key, "comment") && arg) {
+      e->scs = syntaxPoolString(pool, arg);
+    } else if (!strcmp(key, "multiline") && arg) {
+      char *end = strtok(NULL, " \t\r\n");
+      if (end == NULL) continue;
+      e->mcs = syntaxPoolString(pool, arg);
+      e->mce = syntaxPoolString(pool, end);
+    } else if (!strcmp(key, "numbers")) {
+      e->flags |= HL_HIGHLIGHT_NUMBERS;
+    } else if (!strcmp(key, "separators") && arg) {
+      snprintf(seps, sizeof(seps), "%s", arg);
+    } else {
+      // the rest take any number of arguments
+      for (; arg; arg = strtok(NULL, " \t\r\n")) {
+        if (!strcmp(key, "match")) {
+          syntaxPoolAppend(&match, arg, strlen(arg) + 1);
+        } else if (!strcmp(key, "strings")) {
+          e->flags |= HL_HIGHLIGHT_STRINGS;
+          for (; *arg; arg++) e->cls[(unsigned char)*arg] |= SYN_QUOTE;
+        } else if (!strcmp(key, "keywords") || !strcmp(key, "types")) {
+          if (nwords == wordcap) {
+            wordcap = wordcap ? wordcap * 2 : 64;
+            words = memRealloc(MEM_SYNTAX, words,
+                               sizeof(struct syntaxCacheKeyword) * wordcap);
+          }
+          int len = strlen(arg);
+          words[nwords].word = syntaxPoolString(pool, arg);
+          words[nwords].len = len;
+          words[nwords].hl = key[0] == 'k' ? HL_KEYWORD1 : HL_KEYWORD2;
+          if ((unsigned int)len > e->kwmax) e->kwmax = len;
+          nwords++;
+        }
+      }
+    }
+  }
+  free(line);
+  fclose(fp);
+
+  syntaxPoolAppend(&match, "", 1);
+  e->match = pool->len;
+  syntaxPoolAppend(pool, match.b, match.len);
+  memFree(match.b);
+
+  int c;
+  for (c = 0; c < 256; c++)
+    if (isspace(c) || c == '\0' || (c < 128 && strchr(seps, c)))
+      e->cls[c] |= SYN_SEP;
+
+  // the same hash and probing as editorSyntaxCompile
+  unsigned int size = 8;
+  while (size < (unsigned int)nwords * 2) size <<= 1;
+  e->kwmask = size - 1;
+  while (pool->len % 4) syntaxPoolAppend(pool, "", 1);
+  e->kwtable = pool->len;
+  size_t bytes = sizeof(struct syntaxCacheKeyword) * size;
+  memset(syntaxPoolReserve(pool, bytes), 0, bytes);
+  int j;
+  for (j = 0; j < nwords; j++) {
+    const char *word = &pool->b[words[j].word];
+    unsigned int h = editorKeywordHash(word, words[j].len) & e->kwmask;
+    struct syntaxCacheKeyword *slot;
+    for (;;) {
+      slot = (struct syntaxCacheKeyword *)&pool->b[e->kwtable] + h;
+      if (!slot->word || (slot->len == words[j].len &&
+                          !memcmp(&pool->b[slot->word], word, slot->len)))
+        break;
+      h = (h + 1) & e->kwmask;
+    }
+    if (!slot->word) *slot = words[j];
+  }
+  memFree(words);
+  return e->filetype != 0;
+}
+
+// compile the syntax files of dir into one cache image
+char *editorSyntaxBuild(const char *dir, char **names, int n,
+                        unsigned long long stamp, size_t *len) {
+  struct syntaxCacheEntry *entries =
+      memAlloc(MEM_SYNTAX, sizeof(struct syntaxCacheEntry) * n);
+  struct syntaxPool pool = {NULL, 0, 0};
+  // offset 0 stands for none
+  syntaxPoolAppend(&pool, "\0\0\0", 4);
+  int i, count = 0;
+  for (i = 0; i < n; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    if (editorSyntaxParse(path, &entries[count], &pool)) count++;
+  }
+  syntaxPoolAppend(&pool, "", 1);
+
+  struct syntaxCacheHeader h;
+  memset(&h, 0, sizeof(h));
+  h.magic = SYNTAX_CACHE_MAGIC;
+  h.count = count;
+  h.nfiles = n;
+  h.stamp = stamp;
+  size_t head = sizeof(h) + sizeof(struct syntaxCacheEntry) * count;
+  *len = head + pool.len;
+  h.size = *len;
+  char *img = memAlloc(MEM_SYNTAX, *len);
+  memcpy(img, &h, sizeof(h));
+  memcpy(img + sizeof(h), entries, sizeof(struct syntaxCacheEntry) * count);
+  memcpy(img + head, pool.b, pool.len);
+  memFree(entries);
+  memFree(pool.b);
+  return img;
+}
+
+// whether the keyword table of e stays inside the pool and can be probed:
+// mask + 1 slots, a power of two, with at least one of them empty
+int editorSyntaxCheckKeywords(const struct syntaxCacheEntry *e,
+                              const char *pool, size_t len) {
+  if (e->kwtable % 4 || e->kwmask >= len || (e->kwmask & (e->kwmask + 1)) ||
+      e->kwtable + (e->kwmask + 1) * sizeof(struct syntaxCacheKeyword) > len)
+    return 0;
+  const struct syntaxCacheKeyword *kw =
+      (const struct syntaxCacheKeyword *)&pool[e->kwtable];
+  int empty = 0;
+  unsigned int i;
+  for (i = 0; i <= e->kwmask; i++) {
+    if (kw[i].word == 0) {
+      empty = 1;
+      continue;
+    }
+    if (kw[i].word >= len || kw[i].len > e->kwmax ||
+        kw[i].len >= len - kw[i].word ||
+        (kw[i].hl != HL_KEYWORD1 && kw[i].hl != HL_KEYWORD2))
+      return 0;
+  }
+  return empty;
+}
+
+// whether img looks like a cache built from nfiles files with this stamp
+int editorSyntaxCheck(const char *img, size_t len, int nfiles,
+                      unsigned long long stamp) {
+  const struct syntaxCacheHeader *h = (const struct syntaxCacheHeader *)img;
+  if (len < sizeof(*h) || h->magic != SYNTAX_CACHE_MAGIC || h->size != len ||
+      h->nfiles != (unsigned int)nfiles || h->stamp != stamp)
+    return 0;
+  size_t head = sizeof(*h) + sizeof(struct syntaxCacheEntry) * h->count;
+  if (head >= len || img[len - 1] != '\0') return 0;
+  size_t pool = len - head;
+  const struct syntaxCacheEntry *e =
+      (const struct syntaxCacheEntry *)(img + sizeof(*h));
+  unsigned int i;
+  const char *p = img + head;
+  for (i = 0; i < h->count; i++) {
+    if (e[i].filetype >= pool || e[i].match >= pool || e[i].scs >= pool ||
+        e[i].mcs >= pool || e[i].mce >= pool ||
+        !editorSyntaxCheckKeywords(&e[i], p, pool))
+      return 0;
+    // the patterns have to end in an empty one before the pool does
+    size_t m = e[i].match;
+    while (m < pool && p[m]) m += strlen(&p[m]) + 1;
+    if (m >= pool) return 0;
+  }
+  return 1;
+}
+
+// map the syntax cache, rebuilding it first when it is missing or the
+// syntax files changed since it was built
+void editorSyntaxLoad() {
+  char dir[PATH_MAX], path[PATH_MAX];
+  char **names;
+  unsigned long long stamp;
+  if (!editorSyntaxDir(dir, sizeof(dir))) return;
+  int n = editorSyntaxScan(dir, &names, &stamp);
+  if (n < 0) return;
+
+  int cached = editorSyntaxCachePath(path, sizeof(path));
+  if (cached) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+      char *img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (img != MAP_FAILED) {
+        if (editorSyntaxCheck(img, st.st_size, n, stamp)) {
+          E.syntaxdb = img;
+          E.syntaxdblen = st.st_size;
+          E.syntaxdbmapped = 1;
+        } else {
+          munmap(img, st.st_size);
+        }
+      }
+    }
+    if (fd != -1) close(fd);
+  }
+
+  if (E.syntaxdb == NULL) {
+    E.syntaxdb = editorSyntaxBuild(dir, names, n, stamp, &E.syntaxdblen);
+    // written aside and renamed, so a reader never maps half a cache
+    if (cached) {
+      char tmp[PATH_MAX + 16];
+      snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+      int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd != -1) {
+        ssize_t w = write(fd, E.syntaxdb, E.syntaxdblen);
+        close(fd);
+        if (w != (ssize_t)E.syntaxdblen || rename(tmp, path) == -1)
+          unlink(tmp);
+      }
+    }
+  }
+
+  int i;
+  for (i = 0; i < n; i++) memFree(names[i]);
+  memFree(names);
+}
+
+// the cached syntax whose patterns match filename, made ready for use as
+// E.filesyntax; NULL if there is none
+struct editorSyntax *editorSyntaxFind(const char *filename) {
+  if (E.syntaxdb == NULL) return NULL;
+  const struct syntaxCacheHeader *h =
+      (const struct syntaxCacheHeader *)E.syntaxdb;
+  const struct syntaxCacheEntry *entries =
+      (const struct syntaxCacheEntry *)(E.syntaxdb + sizeof(*h));
+  char *pool = E.syntaxdb + sizeof(*h) + sizeof(*entries) * h->count;
+  const char *ext = strrchr(filename, '.');
+
+  unsigned int j;
+  for (j = 0; j < h->count; j++) {
+    const struct syntaxCacheEntry *e = &entries[j];
+    const char *m;
+    for (m = &pool[e->match]; *m; m += strlen(m) + 1) {
+      int is_ext = (m[0] == '.');
+      if ((is_ext && ext && !strcmp(ext, m)) ||
+          (!is_ext && strstr(filename, m)))
+        break;
+    }
+    if (*m == '\0') continue;
+
+    struct editorSyntax *syn = &E.filesyntax;
+    syn->filetype = &pool[e->filetype];
+    syn->filematch = NULL;
+    syn->keywords = NULL;
+    syn->singleline_comment_start = e->scs ? &pool[e->scs] : NULL;
+    syn->multiline_comment_start = e->mcs ? &pool[e->mcs] : NULL;
+    syn->multiline_comment_end = e->mce ? &pool[e->mce] : NULL;
+    syn->flags = e->flags;
+    syn->kwmask = e->kwmask;
+    syn->kwmax = e->kwmax;
+    memcpy(syn->cls, e->cls, sizeof(syn->cls));
+    // the table is hashed already; only the words need turning into
+    // pointers
+    syn->kwtable = memRealloc(MEM_SYNTAX, syn->kwtable,
+                              sizeof(struct editorKeyword) * (e->kwmask + 1));
+    const struct syntaxCacheKeyword *kw =
+        (const struct syntaxCacheKeyword *)&pool[e->kwtable];
+    unsigned int i;
+    for (i = 0; i <= e->kwmask; i++) {
+      syn->kwtable[i].word = kw[i].word ? &pool[kw[i].word] : NULL;
+      syn->kwtable[i].len = kw[i].len;
+      syn->kwtable[i].hl = kw[i].hl;
+    }
+    return syn;
+  }
+  return NULL;
+}
+
+void editorSelectSyntaxHighlight() {
+  editorSyntaxLexStop();
+  // set syntax to NULL
+  E.syntax = NULL;
+
+  // every row has to be relexed and rehighlighted
+  erow *row;
+  for (row = E.cache_head; row; row = row->cache_next) {
+    row->flags |= ROW_HL_DIRTY;
+    if (row->win) row->win->nhls = 0;
+  }
+  E.hl_from = 0;
+  E.hl_to = E.numrows - 1;
+
+  // if no filename, return
+  if (E.filename == NULL) {
+    return;
+  }
+
+  // syntax files come first, the built-in ones are a fallback
+  E.syntax = editorSyntaxFind(E.filename);
+  if (E.syntax) return;
+
+  // get file extension
+  char *ext = strrchr(E.filename, '.');
+
+  // iterate through HLDB
+  for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+    // get syntax
+    struct editorSyntax *s = &HLDB[j];
+    // iterate through filematch
+    unsigned int i = 0;
+    while (s->filematch[i]) {
+      // check if file extension matches
+      int is_ext = (s->filematch[i][0] == '.');
+      if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!is_ext && strstr(E.filename, s->filematch[i]))) {
+        // set syntax
+        E.syntax = s;
+        editorSyntaxCompile(s);
+        return;
+      }
+      i++;
+    }
+  }
+}
+
+/*** undo ***/
+
+size_t undoSize(int textlen) {
+  return sizeof(struct undoRecord) + ((textlen + 7) & ~7) + 8;
+}
+
+struct undoRecord *undoAt(size_t off) {
+  return (struct undoRecord *)&E.undo.log[off];
+}
+
+// the record that ends at off
+struct undoRecord *undoBefore(size_t off) {
+  long long size;
+  memcpy(&size, &E.undo.log[off - 8], 8);
+  return undoAt(off - size);
+}
+
+char *undoText(struct undoRecord *r) {
+  return r->orig >= 0 ? E.orig + r->orig : (char *)(r + 1);
+}
+
+// write the size trailer and make r the last record of the log
+void undoClose(struct undoRecord *r) {
+  char *start = (char *)r;
+  memcpy(start + r->size - 8, &r->size, 8);
+  E.undo.len = E.undo.pos = start - E.undo.log + r->size;
+}
+
+void undoReserve(size_t need) {
+  struct editorUndo *u = &E.undo;
+  if (u->len + need <= u->cap) return;
+  size_t cap = u->cap ? u->cap : 4096;
+  while (cap < u->len + need) cap *= 2;
+  // undoTrim keeps the log under the limit, so it never needs more
+  if (cap > u->limit) cap = u->limit;
+  u->log = memRealloc(MEM_UNDO, u->log, cap);
+  u->cap = cap;
+}
+
+// make room for need more bytes under the limit by dropping the oldest
+// groups, with some to spare so this does not run on every edit
+void undoTrim(size_t need) {
+  struct editorUndo *u = &E.undo;
+  if (u->len + need <= u->limit) return;
+  size_t off = 0;
+  while (off < u->len && u->len - off + need > u->limit / 4 * 3) {
+    unsigned int g = undoAt(off)->group;
+    while (off < u->len && undoAt(off)->group == g) off += undoAt(off)->size;
+    // half a group cannot be undone: forget it and the rest of it
+    if (g == u->group) u->skip = g;
+  }
+  memmove(u->log, &u->log[off], u->len - off);
+  u->len -= off;
+  u->pos = u->len;
+}
+
+// a key typed or deleted next to the last edit of the previous key extends
+// that edit, so a run of typing is undone in one step
+int undoMerge(int type, int row, int col, const char *s, int len) {
+  struct editorUndo *u = &E.undo;
+  if (len != 1 || u->pos == 0) return 0;
+  struct undoRecord *r = undoBefore(u->pos);
+  if (r->type != type || r->row != row || r->orig >= 0) return 0;
+  if (r->group != u->group && r->group + 1 != u->group) return 0;
+  // taking the edit out of a group that did more would split that group
+  size_t at = (char *)r - u->log;
+  if (r->group != u->group && at > 0 && undoBefore(at)->group == r->group)
+    return 0;
+
+  int front;
+  if (type == UNDO_INSERT && col == r->col + r->len) {
+    front = 0;
+  } else if (type == UNDO_DELETE && col == r->col) {
+    front = 0;
+  } else if (type == UNDO_DELETE && col + 1 == r->col) {
+    front = 1;
+  } else {
+    return 0;
+  }
+
+  size_t grow = undoSize(r->len + 1) - r->size;
+  if (u->len + grow > u->limit) return 0;
+  undoReserve(grow);
+  r = undoAt(at);
+  char *text = undoText(r);
+  if (front) {
+    memmove(text + 1, text, r->len);
+    text[0] = s[0];
+    r->col--;
+  } else {
+    text[r->len] = s[0];
+  }
+  r->len++;
+  r->size = undoSize(r->len);
+  r->group = u->group;
+  undoClose(r);
+  return 1;
+}
+
+void undoRecord(int type, int row, int col, const char *s, int len) {
+  struct editorUndo *u = &E.undo;
+  if (u->replay || u->skip == u->group) return;
+  // a new edit ends what can be redone
+  u->len = u->pos;
+  if (undoMerge(type, row, col, s, len)) return;
+
+  int shared = E.orig && s >= E.orig && s + len <= E.orig + E.origlen;
+  size_t size = undoSize(shared ? 0 : len);
+  if (size > u->limit) {
+    u->len = u->pos = 0;
+    u->skip = u->group;
+    return;
+  }
+  undoTrim(size);
+  if (u->skip == u->group) return;
+  undoReserve(size);
+  struct undoRecord *r = undoAt(u->len);
+  r->group = u->group;
+  r->type = type;
+  r->row = row;
+  r->col = col;
+  r->len = len;
+  r->cx = u->cx;
+  r->cy = u->cy;
+  r->acx = E.cx;
+  r->acy = E.cy;
+  r->orig = shared ? s - E.orig : -1;
+  r->size = size;
+  if (!shared) memcpy(r + 1, s, len);
+  undoClose(r);
+}
+
+// start the group of a new key
+void undoBegin() {
+  E.undo.group++;
+  E.undo.cx = E.cx;
+  E.undo.cy = E.cy;
+}
+
+// called after each key: note where the cursor ended up, for redo
+void undoSeal() {
+  struct editorUndo *u = &E.undo;
+  if (u->pos == 0) return;
+  struct undoRecord *r = undoBefore(u->pos);
+  if (r->group != u->group) return;
+  r->acx = E.cx;
+  r->acy = E.cy;
+}
+
+/*** row operations ***/
+// render column after chars[from, to) of row, starting at column rx
+int editorRowColsScan(erow *row, int from, int to, int rx) {
+  int j;
+  for (j = from; j < to; j++) {
+    // if tab, increment rx by tab stop minus remainder of rx divided by tab
+    // stop
+    if (row->chars[j] == '\t') {
+      rx += (MICRO_TAB_STOP - 1) - (rx % MICRO_TAB_STOP);
+    }
+    rx++;
+  }
+  return rx;
+}
+
+// make the first n column checkpoints of row valid, as far as the row goes
+void editorRowColsTo(erow *row, int n) {
+  int max = row->size / MICRO_COL_STRIDE;
+  if (n > max) n = max;
+  if (n <= row->ncols) return;
+  row->cols = memRealloc(MEM_COLS, row->cols, sizeof(int) * max);
+  int k = row->ncols;
+  int rx = k ? row->cols[k - 1] : 0;
+  for (; k < n; k++) {
+    rx = editorRowColsScan(row, k * MICRO_COL_STRIDE,
+                           (k + 1) * MICRO_COL_STRIDE, rx);
+    row->cols[k] = rx;
+  }
+  row->ncols = n;
+}
+
+// chars changed from byte at on and the bytes after the change moved by
+// shift: checkpoints past at no longer hold
+void editorRowColsTrim(erow *row, int at, int shift) {
+  if (row->ncols > at / MICRO_COL_STRIDE) row->ncols = at / MICRO_COL_STRIDE;
+  if (row->win) {
+    struct rowWindow *w = row->win;
+    // keep the state just past the change, if the row was lexed before it,
+    // so editorSyntaxLexLong can tell when the new one agrees with it again
+    int end = shift < 0 ? at - shift : at;
+    int k = end / MICRO_COL_STRIDE + 1;
+    erow *prev = editorRowPrev(row);
+    w->marked = k < w->nhls && editorRowIndex(row) < E.hl_from &&
+                w->hls[0].in_comment == (prev && prev->hl_open_comment);
+    if (w->marked) {
+      w->mark = w->hls[k];
+      w->mark.pos += shift;
+    }
+    // the highlighter looks a little ahead, so what it made of the bytes
+    // just before at may change too
+    at -= editorSyntaxReach();
+    int keep = at < 0 ? 0 : at / MICRO_COL_STRIDE + 1;
+    if (row->win->nhls > keep) row->win->nhls = keep;
+  }
+}
+
+// rows shorter than this are just walked from the start
+#define ROW_COLS_MIN (2 * MICRO_COL_STRIDE)
+
+int editorRowCxToRx(erow *row, int cx) {
+  if (row->size < ROW_COLS_MIN) return editorRowColsScan(row, 0, cx, 0);
+  // start from the last checkpoint at or before cx
+  int k = cx / MICRO_COL_STRIDE;
+  editorRowColsTo(row, k);
+  if (k > row->ncols) k = row->ncols;
+  int rx = k ? row->cols[k - 1] : 0;
+  return editorRowColsScan(row, k * MICRO_COL_STRIDE, cx, rx);
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  // rx - render index
+  int cur_rx = 0;
   // iterate through row
-  int cx;
-  for (cx = 0; cx < row->size; cx++) {
+  int cx = 0;
+  if (row->size >= ROW_COLS_MIN) {
+    // build checkpoints until one lies past rx, then start from the last
+    // one before it
+    while (row->ncols < row->size / MICRO_COL_STRIDE &&
+           (row->ncols == 0 || row->cols[row->ncols - 1] <= rx))
+      editorRowColsTo(row, row->ncols + 16);
+    int lo = 0, hi = row->ncols;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (row->cols[mid] <= rx)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo > 0) {
+      cx = lo * MICRO_COL_STRIDE;
+      cur_rx = row->cols[lo - 1];
+    }
+  }
+  for (; cx < row->size; cx++) {
     // if tab, increment rx by tab stop minus remainder of rx divided by tab
     // stop
     if (row->chars[cx] == '\t') {
@@ -511,7 +2969,59 @@ int editorRowRxToCx(erow *row, int rx) {
   return cx;
 }
 
-void editorUpdateRow(erow *row) {
+void editorRowWindowFree(erow *row) {
+  if (row->win == NULL) return;
+  memFree(row->win->hls);
+  memFree(row->win);
+  row->win = NULL;
+}
+
+// render only the columns of a long row around E.coloff, plus a margin on
+// either side; editorRowCache moves the window along with the screen
+void editorRenderWindow(erow *row) {
+  if (row->flags & ROW_RENDER_ALIAS) {
+    row->render = NULL;
+    row->flags &= ~ROW_RENDER_ALIAS;
+  }
+  if (row->win == NULL)
+    row->win = memCalloc(MEM_RENDER, sizeof(struct rowWindow));
+  struct rowWindow *w = row->win;
+  int from = E.coloff - MICRO_LONG_MARGIN;
+  if (from < 0) from = 0;
+  int to = E.coloff + E.screencols + MICRO_LONG_MARGIN;
+  w->from = editorRowRxToCx(row, from);
+  w->col = editorRowCxToRx(row, w->from);
+
+  row->render = memRealloc(MEM_RENDER, row->render,
+                           to - w->col + MICRO_TAB_STOP + 1);
+  int rx = w->col;
+  int idx = 0;
+  int j;
+  for (j = w->from; j < row->size && rx < to; j++) {
+    if (row->chars[j] == '\t') {
+      row->render[idx++] = ' ';
+      rx++;
+      while (rx % MICRO_TAB_STOP != 0) {
+        row->render[idx++] = ' ';
+        rx++;
+      }
+    } else {
+      row->render[idx++] = row->chars[j];
+      rx++;
+    }
+  }
+  w->to = j;
+  row->render[idx] = '\0';
+  row->rsize = idx;
+}
+
+void editorRenderRow(erow *row) {
+  if (row->size >= MICRO_LONG_ROW) {
+    editorRenderWindow(row);
+    return;
+  }
+  editorRowWindowFree(row);
+
   // tabs - number of tabs
   int tabs = 0;
   // iterate through row
@@ -522,9 +3032,22 @@ void editorUpdateRow(erow *row) {
       tabs++;
     }
   }
-  // free render and allocate memory for render
-  free(row->render);
-  row->render = malloc(row->size + tabs * (MICRO_TAB_STOP - 1) + 1);
+  // nothing to expand: draw chars as they are
+  if (tabs == 0) {
+    if (!(row->flags & ROW_RENDER_ALIAS)) memFree(row->render);
+    row->render = row->chars;
+    row->rsize = row->size;
+    row->flags |= ROW_RENDER_ALIAS;
+    return;
+  }
+  if (row->flags & ROW_RENDER_ALIAS) {
+    row->render = NULL;
+    row->flags &= ~ROW_RENDER_ALIAS;
+  }
+  // realloc memory for render
+  row->render =
+      memRealloc(MEM_RENDER, row->render,
+                 row->size + tabs * (MICRO_TAB_STOP - 1) + 1);
 
   // idx - index
   int idx = 0;
@@ -543,252 +3066,1970 @@ void editorUpdateRow(erow *row) {
   }
   row->render[idx] = '\0';
   row->rsize = idx;
+}
+
+// chars of row changed: drop its cached render/hl and relex it later
+void editorUpdateRow(erow *row) {
+  row->flags |= ROW_RENDER_DIRTY | ROW_HL_DIRTY;
+  rowTreeSetBytes((rownode *)row, row->size + 1);
+  int at = editorRowIndex(row);
+  editorSyntaxInvalidate(at, at);
+}
 
-  editorUpdateSyntax(row);
+/*** render cache ***/
+
+void editorCacheUnlink(erow *row) {
+  if (!(row->flags & ROW_CACHED)) return;
+  if (row->cache_prev)
+    row->cache_prev->cache_next = row->cache_next;
+  else
+    E.cache_head = row->cache_next;
+  if (row->cache_next)
+    row->cache_next->cache_prev = row->cache_prev;
+  else
+    E.cache_tail = row->cache_prev;
+  row->cache_prev = row->cache_next = NULL;
+  row->flags &= ~ROW_CACHED;
+  E.cached--;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  // if at is less than 0 or greater than number of rows, return
-  if (at < 0 || at > E.numrows) {
-    return;
+void editorCacheDrop(erow *row) {
+  editorCacheUnlink(row);
+  if (!(row->flags & ROW_RENDER_ALIAS)) memFree(row->render);
+  memFree(row->hl);
+  memFree(row->cols);
+  editorRowWindowFree(row);
+  row->render = NULL;
+  row->hl = NULL;
+  row->cols = NULL;
+  row->ncols = 0;
+  row->hlruns = 0;
+  row->rsize = 0;
+  row->flags &= ~ROW_RENDER_ALIAS;
+  row->flags |= ROW_RENDER_DIRTY | ROW_HL_DIRTY;
+}
+
+// make render and hl of row current and mark it most recently used; only
+// the last few screens worth of rows are kept, so this must be called again
+// after anything that may evict (i.e. another editorRowCache)
+void editorRowCache(erow *row) {
+  // a long row is rendered around the screen; follow it when it leaves
+  struct rowWindow *w = row->win;
+  if (w && (E.coloff < w->col ||
+            (w->to < row->size &&
+             E.coloff + E.screencols > w->col + row->rsize)))
+    row->flags |= ROW_RENDER_DIRTY;
+  if (row->flags & ROW_RENDER_DIRTY) {
+    editorRenderRow(row);
+    row->flags &= ~ROW_RENDER_DIRTY;
+    row->flags |= ROW_HL_DIRTY;
+  }
+  if (row->flags & ROW_HL_DIRTY) {
+    editorHighlightRow(row);
+    row->flags &= ~ROW_HL_DIRTY;
+  }
+
+  // move row to the front of the cache list
+  if (E.cache_head != row) {
+    editorCacheUnlink(row);
+    row->cache_prev = NULL;
+    row->cache_next = E.cache_head;
+    if (E.cache_head) E.cache_head->cache_prev = row;
+    E.cache_head = row;
+    if (E.cache_tail == NULL) E.cache_tail = row;
+    row->flags |= ROW_CACHED;
+    E.cached++;
+  }
+
+  int cap = E.screenrows * MICRO_CACHE_SCREENS;
+  while (E.cached > cap && E.cache_tail != row) editorCacheDrop(E.cache_tail);
+}
+
+rownode *editorNewNode(int nlines) {
+  rownode *n = slabAlloc(MEM_TREE, sizeof(rownode));
+  memset(n, 0, sizeof(rownode));
+  n->prio = (unsigned int)rand();
+  n->nlines = nlines;
+  n->count = nlines;
+  n->nbytes = n->bytes = nlines;
+  return n;
+}
+
+// turn line off of a span into a row of its own, splitting the span around
+// it; this is where lines of a freshly opened file are first rendered
+erow *editorOpenSpanLine(rownode *span, int at, int off) {
+  char *end = span->row.chars + span->row.size;
+  char *line = span->row.chars;
+  int i;
+  for (i = 0; i < off; i++) line = (char *)memchr(line, '\n', end - line) + 1;
+  char *nl = memchr(line, '\n', end - line);
+  char *eol = nl ? nl : end;
+  int len = eol - line;
+  while (len > 0 && line[len - 1] == '\r') len--;
+
+  rownode *a, *b, *mid;
+  rowTreeSplit(E.rows, at - off, &a, &b);
+  rowTreeSplit(b, span->nlines, &mid, &b);
+
+  rownode *prev = a;
+  while (prev && prev->right) prev = prev->right;
+  int in_comment = prev ? prev->row.hl_open_comment : 0;
+
+  rownode *right = NULL;
+  if (nl && off + 1 < span->nlines) {
+    right = editorNewNode(span->nlines - off - 1);
+    right->row.chars = nl + 1;
+    right->row.size = end - (nl + 1);
+    right->row.flags = ROW_BORROWED | ROW_SPAN;
+    right->row.hl_open_comment = span->row.hl_open_comment;
+    rowTreeSetBytes(right, editorSpanBytes(nl + 1, end));
   }
 
-  // realloc memory for rows
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-  // memmove - copies len bytes from string s to string E.row
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-  // iterate through rows
-  for (int j = at + 1; j <= E.numrows; j++) {
-    E.row[j].idx++;
+  rownode *left = NULL;
+  if (off > 0) {
+    left = span;
+    left->nlines = off;
+    left->row.size = line - left->row.chars;
+    left->nbytes = editorSpanBytes(left->row.chars, line);
+    left->row.hl_open_comment =
+        editorSyntaxLexLines(left->row.chars, line, off, in_comment);
+    left->left = left->right = NULL;
+    rowTreeUpdate(left);
+    in_comment = left->row.hl_open_comment;
+  } else {
+    slabFree(MEM_TREE, span, sizeof(rownode));
   }
 
-  E.row[at].idx = at;
+  // the text is unchanged, so the rows around need no relexing
+  rownode *n = editorNewNode(1);
+  n->row.chars = line;
+  n->row.size = len;
+  rowTreeSetBytes(n, len + 1);
+  n->row.flags = ROW_BORROWED | ROW_RENDER_DIRTY | ROW_HL_DIRTY;
+  n->row.hl_open_comment = editorSyntaxLexLine(line, len, in_comment);
+
+  a = rowTreeMerge(a, left);
+  b = rowTreeMerge(right, b);
+  rowTreeSetRoot(rowTreeMerge(rowTreeMerge(a, n), b));
+  return &n->row;
+}
+
+erow *editorRowAt(int at) {
+  if (at < 0 || at >= E.numrows) return NULL;
+  int off;
+  rownode *n = rowTreeFind(at, &off);
+  if (n->row.flags & ROW_SPAN) return editorOpenSpanLine(n, at, off);
+  return &n->row;
+}
+
+// link a blank row into the tree at position at; O(log n) expected
+erow *editorNewRow(int at) {
+  rownode *n = editorNewNode(1);
+
+  // make sure at is a row boundary and not inside a span
+  editorRowAt(at);
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  // start from the state the row below was lexed with, so it is only
+  // rehighlighted if the new row really changes it
+  erow *prev = editorRowAt(at - 1);
+  n->row.hl_open_comment = prev ? prev->hl_open_comment : 0;
+  if (E.hl_to >= at) E.hl_to++;
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hl_open_comment = 0;
-  editorUpdateRow(&E.row[at]);
+  rownode *a, *b;
+  rowTreeSplit(E.rows, at, &a, &b);
+  rowTreeSetRoot(rowTreeMerge(rowTreeMerge(a, n), b));
+  return &n->row;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  // if at is less than 0 or greater than number of rows, return
+  if (at < 0 || at > E.numrows) {
+    return;
+  }
+
+  undoRecord(UNDO_ROW_INSERT, at, 0, s, len);
+  erow *row = editorNewRow(at);
+  row->size = len;
+  row->chars = slabAlloc(MEM_TEXT, len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+  editorUpdateRow(row);
 
-  E.numrows++;
   E.dirty++;
 }
 
+void editorRowOwn(erow *row) {
+  if (!(row->flags & ROW_BORROWED)) return;
+  char *chars = slabAlloc(MEM_TEXT, row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->flags &= ~ROW_BORROWED;
+  // an aliased render still points at the old chars
+  row->flags |= ROW_RENDER_DIRTY;
+}
+
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
+  editorCacheDrop(row);
+  if (!(row->flags & ROW_BORROWED))
+    slabFree(MEM_TEXT, row->chars, row->size + 1);
 }
 
 void editorDelRow(int at) {
   if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-  E.numrows--;
+  erow *row = editorRowAt(at);
+  undoRecord(UNDO_ROW_DELETE, at, 0, row->chars, row->size);
+  erow *next = editorRowNext(row);
+  if (next) next->flags |= ROW_HL_DIRTY;
+  if (E.hl_to > at) E.hl_to--;
+
+  rownode *a, *mid, *b;
+  rowTreeSplit(E.rows, at, &a, &b);
+  rowTreeSplit(b, 1, &mid, &b);
+  rowTreeSetRoot(rowTreeMerge(a, b));
+  // the row that moved up into at has to be checked too, even when an
+  // edit further up settles first
+  editorSyntaxInvalidate(at, at);
+  editorFreeRow(&mid->row);
+  slabFree(MEM_TREE, mid, sizeof(rownode));
   E.dirty++;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
   if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
+  undoRecord(UNDO_INSERT, editorRowIndex(row), at, s, len);
+  editorRowOwn(row);
+  row->chars =
+      slabRealloc(MEM_TEXT, row->chars, row->size + 1, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorRowColsTrim(row, at, len);
   editorUpdateRow(row);
   E.dirty++;
 }
 
+void editorRowInsertChar(erow *row, int at, int c) {
+  char ch = c;
+  editorRowInsertString(row, at, &ch, 1);
+}
+
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
+  editorRowInsertString(row, row->size, s, len);
 }
 
-void editorRowDelChar(erow *row, int at) {
+void editorRowDelRange(erow *row, int at, int len) {
   if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
+  if (len > row->size - at) len = row->size - at;
+  undoRecord(UNDO_DELETE, editorRowIndex(row), at, &row->chars[at], len);
+  editorRowOwn(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  row->chars =
+      slabRealloc(MEM_TEXT, row->chars, row->size + 1, row->size - len + 1);
+  row->size -= len;
+  editorRowColsTrim(row, at, -len);
   editorUpdateRow(row);
   E.dirty++;
 }
 
+void editorRowDelChar(erow *row, int at) { editorRowDelRange(row, at, 1); }
+
 /*** editor operations ***/
 
 void editorInsertChar(int c) {
   if (E.cy == E.numrows) {
     editorInsertRow(E.numrows, "", 0);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+  E.cx++;
+}
+
+void editorInsertNewline() {
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    erow *row = editorRowAt(E.cy);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    editorRowDelRange(row, E.cx, row->size - E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// insert a block of text at the cursor as one edit: every row it touches
+// is changed once, so it is rendered and relexed once. Lines may end in
+// \r, \n or \r\n, since terminals paste newlines as carriage returns
+void editorInsertText(const char *s, int len) {
+  const char *end = s + len;
+  const char *eol = s;
+  while (eol < end && *eol != '\r' && *eol != '\n') eol++;
+
+  if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+  erow *row = editorRowAt(E.cy);
+  if (eol == end) {
+    editorRowInsertString(row, E.cx, s, len);
+    E.cx += len;
+    return;
+  }
+
+  // split the row at the cursor: the first line goes on the head, the last
+  // one in front of the tail
+  int tlen = row->size - E.cx;
+  char *tail = memAlloc(MEM_TEXT, tlen + 1);
+  memcpy(tail, &row->chars[E.cx], tlen);
+  editorRowDelRange(row, E.cx, tlen);
+  editorRowAppendString(row, (char *)s, eol - s);
+
+  while (eol < end) {
+    s = eol + (eol + 1 < end && eol[0] == '\r' && eol[1] == '\n' ? 2 : 1);
+    eol = s;
+    while (eol < end && *eol != '\r' && *eol != '\n') eol++;
+    E.cy++;
+    editorInsertRow(E.cy, (char *)s, eol - s);
+  }
+  E.cx = eol - s;
+  if (tlen) editorRowAppendString(editorRowAt(E.cy), tail, tlen);
+  memFree(tail);
+}
+
+void editorDelChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = editorRowAt(E.cy);
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    erow *prev = editorRowAt(E.cy - 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+// apply r, or its inverse when undoing
+void undoApply(struct undoRecord *r, int redo) {
+  static const int inverse[] = {UNDO_DELETE, UNDO_INSERT, UNDO_ROW_DELETE,
+                                UNDO_ROW_INSERT};
+  int type = redo ? r->type : inverse[r->type];
+  switch (type) {
+    case UNDO_INSERT:
+      editorRowInsertString(editorRowAt(r->row), r->col, undoText(r), r->len);
+      break;
+    case UNDO_DELETE:
+      editorRowDelRange(editorRowAt(r->row), r->col, r->len);
+      break;
+    case UNDO_ROW_INSERT:
+      editorInsertRow(r->row, undoText(r), r->len);
+      break;
+    case UNDO_ROW_DELETE:
+      editorDelRow(r->row);
+      break;
+  }
+}
+
+void editorUndo() {
+  struct editorUndo *u = &E.undo;
+  if (u->pos == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  unsigned int g = undoBefore(u->pos)->group;
+  u->replay = 1;
+  while (u->pos > 0 && undoBefore(u->pos)->group == g) {
+    struct undoRecord *r = undoBefore(u->pos);
+    undoApply(r, 0);
+    u->pos -= r->size;
+    E.cx = r->cx;
+    E.cy = r->cy;
+  }
+  u->replay = 0;
+}
+
+void editorRedo() {
+  struct editorUndo *u = &E.undo;
+  if (u->pos == u->len) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  unsigned int g = undoAt(u->pos)->group;
+  u->replay = 1;
+  while (u->pos < u->len && undoAt(u->pos)->group == g) {
+    struct undoRecord *r = undoAt(u->pos);
+    undoApply(r, 1);
+    u->pos += r->size;
+    E.cx = r->acx;
+    E.cy = r->acy;
+  }
+  u->replay = 0;
+}
+
+/*** file i/o ***/
+
+void editorOpen(char *filename) {
+  memFree(E.filename);
+  E.filename = memStrdup(MEM_FILE, filename);
+
+  editorSelectSyntaxHighlight();
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+
+  // map regular files; anything else is read into one buffer. Either way
+  // rows borrow their text from E.orig
+  struct stat st;
+  if (fstat(fd, &st) == -1) die("fstat");
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origmapped = 0;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    E.orig = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (E.orig == MAP_FAILED) {
+      E.orig = NULL;
+    } else {
+      E.origlen = st.st_size;
+      E.origmapped = 1;
+    }
+  }
+  if (!E.origmapped) {
+    size_t cap = 4096;
+    E.orig = memAlloc(MEM_FILE, cap);
+    ssize_t n;
+    while ((n = read(fd, &E.orig[E.origlen], cap - E.origlen)) != 0) {
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        die("read");
+      }
+      E.origlen += n;
+      if (E.origlen == cap) {
+        cap *= 2;
+        E.orig = memRealloc(MEM_FILE, E.orig, cap);
+      }
+    }
+  }
+  close(fd);
+
+  // the only work done up front is one pass over the newlines, cutting the
+  // file into spans of MICRO_SPAN_LINES lines; lines become rows (and get
+  // rendered) when editorRowAt first reaches them
+  int nspans = 0, spancap = 0;
+  rownode **spans = NULL;
+  char *p = E.orig;
+  char *end = E.orig + E.origlen;
+  while (p < end) {
+    char *start = p;
+    int nlines = 0;
+    while (p < end && nlines < MICRO_SPAN_LINES) {
+      char *nl = memchr(p, '\n', end - p);
+      p = nl ? nl + 1 : end;
+      nlines++;
+    }
+    if (nspans == spancap) {
+      spancap = spancap ? spancap * 2 : 64;
+      spans = memRealloc(MEM_TREE, spans, sizeof(rownode *) * spancap);
+    }
+    rownode *n = editorNewNode(nlines);
+    n->row.chars = start;
+    n->row.size = p - start;
+    n->row.flags = ROW_BORROWED | ROW_SPAN;
+    rowTreeSetBytes(n, editorSpanBytes(start, p));
+    spans[nspans++] = n;
+  }
+  rowTreeSetRoot(rowTreeBuild(spans, nspans));
+
+  // the screen is settled on the first draw; the rest of the file is
+  // lexed by threads in the background when there are cores to spare, or
+  // else during idle ticks
+  editorSyntaxInvalidate(0, E.numrows - 1);
+  editorSyntaxLexStart(spans, nspans);
+  memFree(spans);
+  E.dirty = 0;
+}
+
+// drop the document and everything that points into it
+void editorClose() {
+  editorSyntaxLexStop();
+  // rows and their text all live in the slabs; only the render cache and
+  // column checkpoints, which outlive it, are kept elsewhere
+  erow *row;
+  for (row = editorRowFirst(); row; row = editorRowNext(row))
+    editorCacheDrop(row);
+  slabRelease();
+  rowTreeSetRoot(NULL);
+  if (E.origmapped)
+    munmap(E.orig, E.origlen);
+  else
+    memFree(E.orig);
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origmapped = 0;
+  E.undo.len = E.undo.pos = 0;
+  E.cx = E.cy = 0;
+  E.rowoff = E.coloff = 0;
+  E.match_row = -1;
+  E.hl_from = INT_MAX;
+  E.hl_to = -1;
+  E.dirty = 0;
+  memFree(E.filename);
+  E.filename = NULL;
+  E.syntax = NULL;
+}
+
+// rows are saved straight from where they live, gathered into writev
+// batches, so saving needs no copy of the document
+struct saveWriter {
+  int fd;
+  struct iovec iov[MICRO_SAVE_IOV];
+  int n;
+  long long total;
+};
+
+int saveFlush(struct saveWriter *w) {
+  struct iovec *iov = w->iov;
+  int n = w->n;
+  w->n = 0;
+  while (n > 0) {
+    ssize_t r = writev(w->fd, iov, n);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    // a short write: skip what went out and go again
+    while (n > 0 && (size_t)r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *)iov->iov_base + r;
+      iov->iov_len -= r;
+    }
+  }
+  return 0;
+}
+
+int saveAdd(struct saveWriter *w, const char *p, size_t len) {
+  if (len == 0) return 0;
+  w->total += len;
+  if (w->n > 0) {
+    // text that directly follows the previous piece, as unedited lines of
+    // the original file do, just extends it
+    struct iovec *last = &w->iov[w->n - 1];
+    if ((char *)last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return 0;
+    }
+  }
+  if (w->n == MICRO_SAVE_IOV && saveFlush(w) == -1) return -1;
+  w->iov[w->n].iov_base = (char *)p;
+  w->iov[w->n].iov_len = len;
+  w->n++;
+  return 0;
+}
+
+// the line that was just added ends here; reuse the newline that follows
+// it in the original file if there is one
+int saveNewline(struct saveWriter *w) {
+  if (w->n > 0 && E.orig) {
+    struct iovec *last = &w->iov[w->n - 1];
+    char *end = (char *)last->iov_base + last->iov_len;
+    if (end >= E.orig && end < E.orig + E.origlen && *end == '\n')
+      return saveAdd(w, end, 1);
+  }
+  return saveAdd(w, "\n", 1);
+}
+
+int saveRows(struct saveWriter *w) {
+  erow *row;
+  for (row = editorRowFirst(); row; row = editorRowNext(row)) {
+    if (!(row->flags & ROW_SPAN)) {
+      if (saveAdd(w, row->chars, row->size) == -1) return -1;
+      if (saveNewline(w) == -1) return -1;
+      continue;
+    }
+    char *s = row->chars;
+    char *end = row->chars + row->size;
+    if (memchr(s, '\r', end - s) == NULL) {
+      // the text of the span is already the file's text
+      if (saveAdd(w, s, end - s) == -1) return -1;
+      if (s < end && end[-1] != '\n' && saveNewline(w) == -1) return -1;
+      continue;
+    }
+    // carriage returns are dropped from line ends, as when opening a line
+    while (s < end) {
+      char *nl = memchr(s, '\n', end - s);
+      char *eol = nl ? nl : end;
+      size_t len = eol - s;
+      while (len > 0 && s[len - 1] == '\r') len--;
+      if (saveAdd(w, s, len) == -1 || saveNewline(w) == -1) return -1;
+      s = eol + 1;
+    }
+  }
+  return saveFlush(w);
+}
+
+// flush the rename itself to disk; failing that is not worth reporting
+void saveSyncDir(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  char dir[PATH_MAX] = ".";
+  if (slash && slash - filename < PATH_MAX - 1) {
+    memcpy(dir, filename, slash - filename + 1);
+    dir[slash - filename + 1] = '\0';
+  }
+  int fd = open(dir, O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+// give the mapping of E.orig private copies of all its pages, so the file
+// under it can be rewritten without changing the rows that borrow from it
+int editorOrigDetach() {
+  if (!E.origmapped || E.origlen == 0) return 0;
+  editorSyntaxLexStop();
+  long page = sysconf(_SC_PAGESIZE);
+  size_t i;
+  if (mprotect(E.orig, E.origlen, PROT_READ | PROT_WRITE) == -1) return -1;
+  for (i = 0; i < E.origlen; i += page) {
+    volatile char *c = &E.orig[i];
+    *c = *c;
+  }
+  return mprotect(E.orig, E.origlen, PROT_READ);
+}
+
+// a file with other hard links is rewritten in place: a rename would give
+// this name a new inode and leave the other names on the old contents
+int saveInPlace(struct saveWriter *w, const char *path) {
+  if (editorOrigDetach() == -1) return -1;
+  w->fd = open(path, O_WRONLY);
+  if (w->fd == -1) return -1;
+  if (saveRows(w) == -1 || ftruncate(w->fd, w->total) == -1 ||
+      fsync(w->fd) == -1) {
+    int saved_errno = errno;
+    close(w->fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return close(w->fd);
+}
+
+void editorSave() {
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntaxHighlight();
+  }
+
+  // a symlink is saved through to the file it points at, so the link
+  // stays a link
+  char resolved[PATH_MAX];
+  const char *target = realpath(E.filename, resolved);
+  if (target == NULL) target = E.filename;
+  struct saveWriter w;
+  w.n = 0;
+  w.total = 0;
+  struct stat st;
+  int exists = stat(target, &st) == 0;
+  if (exists && st.st_nlink > 1) {
+    if (saveInPlace(&w, target) == 0) {
+      E.dirty = 0;
+      editorSetStatusMessage("%lld bytes written to disk", w.total);
+      return;
+    }
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  // E.orig may be a mapping of this very file, so it must not be rewritten
+  // in place: write a sibling file, sync it and rename it over the
+  // original, which never leaves a half-written file behind
+  size_t namelen = strlen(target);
+  char *tmpname = memAlloc(MEM_FILE, namelen + 8);
+  memcpy(tmpname, target, namelen);
+  memcpy(&tmpname[namelen], ".XXXXXX", 8);
+
+  w.fd = mkstemp(tmpname);
+  if (w.fd != -1) {
+    mode_t mode;
+    if (exists) {
+      mode = st.st_mode & 07777;
+    } else {
+      mode = umask(0);
+      umask(mode);
+      mode = 0644 & ~mode;
+    }
+    if (fchmod(w.fd, mode) != -1 && saveRows(&w) != -1 &&
+        fsync(w.fd) != -1) {
+      if (close(w.fd) == 0 && rename(tmpname, target) == 0) {
+        saveSyncDir(target);
+        memFree(tmpname);
+        E.dirty = 0;
+        editorSetStatusMessage("%lld bytes written to disk", w.total);
+        return;
+      }
+    } else {
+      close(w.fd);
+    }
+    int saved_errno = errno;
+    unlink(tmpname);
+    errno = saved_errno;
+  }
+
+  memFree(tmpname);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+/*** regex ***/
+
+// Patterns for Ctrl-R in the find prompt. A pattern is parsed into a tree
+// of nodes and compiled twice into a Thompson NFA: forwards, behind an
+// implicit .*? so it matches anywhere, and reversed and anchored. Each
+// program is run as a DFA whose states are built the first time a scan
+// reaches them, so every byte costs one table lookup and no pattern can
+// backtrack. Matches are leftmost-first, as in Perl, and never cross a
+// line. Supported: literals, ., [...] and [^...] with ranges, \d \w \s and
+// their negations, \t \n \r \f \v, other escaped punctuation, ^ $, |, (),
+// (?:), and * + ? {m} {m,} {m,n}, each of them lazy with a trailing ?.
+
+enum regexNodeType { RN_SET, RN_CAT, RN_ALT, RN_REPEAT, RN_BOL, RN_EOL,
+                     RN_EMPTY };
+struct regexNode {
+  int type;
+  // set - the byte set of RN_SET; a and b - the children
+  int set;
+  int a;
+  int b;
+  // min and max of RN_REPEAT; max is -1 for no bound
+  int min;
+  int max;
+  int greedy;
+  // depth - repeats nested below and including this node
+  int depth;
+};
+struct regexParser {
+  const char *p;
+  const char *end;
+  struct regex *re;
+  struct regexNode *nodes;
+  int nnodes;
+  int cap;
+  const char *err;
+  // depth - groups open around the one being parsed
+  int depth;
+  // the program being emitted
+  struct regexInst *prog;
+  int nprog;
+  int progcap;
+};
+
+int regexNodeNew(struct regexParser *ps, int type, int a, int b) {
+  if (ps->nnodes == ps->cap) {
+    ps->cap = ps->cap ? ps->cap * 2 : 32;
+    ps->nodes =
+        memRealloc(MEM_SEARCH, ps->nodes, sizeof(struct regexNode) * ps->cap);
+  }
+  struct regexNode *n = &ps->nodes[ps->nnodes];
+  n->type = type;
+  n->set = -1;
+  n->a = a;
+  n->b = b;
+  n->min = n->max = 0;
+  n->greedy = 1;
+  n->depth = 0;
+  if (a >= 0) n->depth = ps->nodes[a].depth;
+  if (b >= 0 && ps->nodes[b].depth > n->depth) n->depth = ps->nodes[b].depth;
+  if (type == RN_REPEAT) n->depth++;
+  return ps->nnodes++;
+}
+
+int regexSetNew(struct regex *re) {
+  re->sets = memRealloc(MEM_SEARCH, re->sets, 32 * (re->nsets + 1));
+  memset(re->sets[re->nsets], 0, 32);
+  return re->nsets++;
+}
+
+void regexSetAdd(unsigned char *set, int from, int to) {
+  int c;
+  for (c = from; c <= to; c++) set[c >> 3] |= 1 << (c & 7);
+}
+
+int regexSetHas(const unsigned char *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+// add what \c stands for to set; false if c is not a known escape
+int regexEscape(unsigned char *set, int c) {
+  int i, neg = isupper(c);
+  unsigned char tmp[32] = {0};
+  switch (tolower(c)) {
+    case 'd':
+      regexSetAdd(tmp, '0', '9');
+      break;
+    case 'w':
+      regexSetAdd(tmp, '0', '9');
+      regexSetAdd(tmp, 'a', 'z');
+      regexSetAdd(tmp, 'A', 'Z');
+      regexSetAdd(tmp, '_', '_');
+      break;
+    case 's':
+      regexSetAdd(tmp, '\t', '\r');
+      regexSetAdd(tmp, ' ', ' ');
+      break;
+    default:
+      neg = 0;
+      if (c == 't') c = '\t';
+      else if (c == 'n') c = '\n';
+      else if (c == 'r') c = '\r';
+      else if (c == 'f') c = '\f';
+      else if (c == 'v') c = '\v';
+      else if (isalnum(c)) return 0;
+      regexSetAdd(tmp, c, c);
+  }
+  for (i = 0; i < 32; i++) set[i] |= neg ? ~tmp[i] : tmp[i];
+  return 1;
+}
+
+int regexParseAlt(struct regexParser *ps);
+
+// [...] after the [; a negated class never takes the newline
+int regexParseClass(struct regexParser *ps) {
+  int set = regexSetNew(ps->re);
+  unsigned char *s = ps->re->sets[set];
+  int neg = ps->p < ps->end && *ps->p == '^';
+  if (neg) ps->p++;
+  int first = 1;
+  while (ps->p < ps->end && (*ps->p != ']' || first)) {
+    int lo = (unsigned char)*ps->p++;
+    first = 0;
+    if (lo == '\\' && ps->p < ps->end) {
+      int c = (unsigned char)*ps->p++;
+      if (strchr("dDwWsS", c)) {
+        regexEscape(s, c);
+        continue;
+      }
+      unsigned char one[32] = {0};
+      if (!regexEscape(one, c)) {
+        ps->err = "bad escape";
+        return -1;
+      }
+      for (lo = 0; !regexSetHas(one, lo); lo++)
+        ;
+    }
+    int hi = lo;
+    if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+      if (hi < lo) {
+        ps->err = "bad range";
+        return -1;
+      }
+    }
+    regexSetAdd(s, lo, hi);
+  }
+  if (ps->p == ps->end) {
+    ps->err = "missing ]";
+    return -1;
+  }
+  ps->p++;
+  if (neg) {
+    int i;
+    for (i = 0; i < 32; i++) s[i] = ~s[i];
+    s['\n' >> 3] &= ~(1 << ('\n' & 7));
+  }
+  int n = regexNodeNew(ps, RN_SET, -1, -1);
+  ps->nodes[n].set = set;
+  return n;
+}
+
+int regexParseAtom(struct regexParser *ps) {
+  int c = (unsigned char)*ps->p++;
+  int n, set;
+  switch (c) {
+    case '(':
+      if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':')
+        ps->p += 2;
+      if (ps->depth == MICRO_REGEX_DEPTH) {
+        ps->err = "regex too deep";
+        return -1;
+      }
+      ps->depth++;
+      n = regexParseAlt(ps);
+      ps->depth--;
+      if (n < 0) return -1;
+      if (ps->p == ps->end || *ps->p != ')') {
+        ps->err = "missing )";
+        return -1;
+      }
+      ps->p++;
+      return n;
+    case '[':
+      return regexParseClass(ps);
+    case '^':
+      return regexNodeNew(ps, RN_BOL, -1, -1);
+    case '$':
+      return regexNodeNew(ps, RN_EOL, -1, -1);
+    case '*':
+    case '+':
+    case '?':
+      ps->err = "nothing to repeat";
+      return -1;
+  }
+  set = regexSetNew(ps->re);
+  unsigned char *s = ps->re->sets[set];
+  if (c == '.') {
+    regexSetAdd(s, 0, 255);
+    s['\n' >> 3] &= ~(1 << ('\n' & 7));
+  } else if (c == '\\') {
+    if (ps->p == ps->end || !regexEscape(s, (unsigned char)*ps->p++)) {
+      ps->err = "bad escape";
+      return -1;
+    }
+  } else {
+    regexSetAdd(s, c, c);
+  }
+  n = regexNodeNew(ps, RN_SET, -1, -1);
+  ps->nodes[n].set = set;
+  return n;
+}
+
+// a decimal count of {m,n}; -1 if there are no digits
+int regexParseCount(struct regexParser *ps) {
+  int n = -1;
+  while (ps->p < ps->end && isdigit((unsigned char)*ps->p)) {
+    n = (n < 0 ? 0 : n) * 10 + (*ps->p++ - '0');
+    if (n > 1000) n = 1001;
+  }
+  return n;
+}
+
+int regexParseRepeat(struct regexParser *ps) {
+  int n = regexParseAtom(ps);
+  while (n >= 0 && ps->p < ps->end) {
+    int min, max;
+    char c = *ps->p;
+    if (c == '*') {
+      min = 0;
+      max = -1;
+    } else if (c == '+') {
+      min = 1;
+      max = -1;
+    } else if (c == '?') {
+      min = 0;
+      max = 1;
+    } else if (c == '{' && ps->end - ps->p > 1 &&
+               isdigit((unsigned char)ps->p[1])) {
+      ps->p++;
+      min = max = regexParseCount(ps);
+      if (ps->p < ps->end && *ps->p == ',') {
+        ps->p++;
+        max = regexParseCount(ps);
+      }
+      if (ps->p == ps->end || *ps->p != '}') {
+        ps->err = "missing }";
+        return -1;
+      }
+      if (min > 1000 || max > 1000 || (max >= 0 && max < min)) {
+        ps->err = "bad count";
+        return -1;
+      }
+    } else {
+      break;
+    }
+    ps->p++;
+    if (ps->nodes[n].depth == MICRO_REGEX_DEPTH) {
+      ps->err = "regex too deep";
+      return -1;
+    }
+    int r = regexNodeNew(ps, RN_REPEAT, n, -1);
+    ps->nodes[r].min = min;
+    ps->nodes[r].max = max;
+    if (ps->p < ps->end && *ps->p == '?') {
+      ps->nodes[r].greedy = 0;
+      ps->p++;
+    }
+    n = r;
+  }
+  return n;
+}
+
+int regexParseCat(struct regexParser *ps) {
+  int n = -1;
+  while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+    int b = regexParseRepeat(ps);
+    if (b < 0) return -1;
+    n = n < 0 ? b : regexNodeNew(ps, RN_CAT, n, b);
+  }
+  return n < 0 ? regexNodeNew(ps, RN_EMPTY, -1, -1) : n;
+}
+
+int regexParseAlt(struct regexParser *ps) {
+  int n = regexParseCat(ps);
+  while (n >= 0 && ps->p < ps->end && *ps->p == '|') {
+    ps->p++;
+    int b = regexParseCat(ps);
+    n = b < 0 ? -1 : regexNodeNew(ps, RN_ALT, n, b);
+  }
+  return n;
+}
+
+int regexEmitInst(struct regexParser *ps, int op, int x, int y) {
+  if (ps->nprog == ps->progcap) {
+    ps->progcap = ps->progcap ? ps->progcap * 2 : 64;
+    ps->prog = memRealloc(MEM_SEARCH, ps->prog,
+                          sizeof(struct regexInst) * ps->progcap);
+  }
+  struct regexInst *in = &ps->prog[ps->nprog];
+  in->op = op;
+  in->x = x;
+  in->y = y;
+  return ps->nprog++;
+}
+
+// the nodes that a tree of type nodes under n joins, in order; n itself if
+// it is not of that type. Chains like abc or a|b|c are walked here rather
+// than recursed into, however long they are
+int regexLeaves(struct regexParser *ps, int n, int type, int **out) {
+  int *stack = NULL, sp = 0, cap = 0, k = 0, outcap = 0;
+  *out = NULL;
+  for (;;) {
+    struct regexNode *nd = &ps->nodes[n];
+    if (nd->type == type) {
+      if (sp == cap) {
+        cap = cap ? cap * 2 : 16;
+        stack = memRealloc(MEM_SEARCH, stack, sizeof(int) * cap);
+      }
+      stack[sp++] = nd->b;
+      n = nd->a;
+      continue;
+    }
+    if (k == outcap) {
+      outcap = outcap ? outcap * 2 : 16;
+      *out = memRealloc(MEM_SEARCH, *out, sizeof(int) * outcap);
+    }
+    (*out)[k++] = n;
+    if (sp == 0) break;
+    n = stack[--sp];
+  }
+  memFree(stack);
+  return k;
+}
+
+// emit node n; reversed, concatenations run backwards and ^ and $ trade
+// places, which gives a program that matches the text read back to front.
+// Only groups and repeats recurse, so MICRO_REGEX_DEPTH bounds the depth
+void regexEmit(struct regexParser *ps, int n, int rev) {
+  struct regexNode *nd = &ps->nodes[n];
+  int i, l, k, *leaves, *jumps;
+  if (ps->nprog > MICRO_REGEX_PROG) {
+    ps->err = "regex too big";
+    return;
+  }
+  switch (nd->type) {
+    case RN_SET:
+      regexEmitInst(ps, RE_BYTE, nd->set, 0);
+      break;
+    case RN_BOL:
+    case RN_EOL:
+      regexEmitInst(ps, (nd->type == RN_BOL) != rev ? RE_BOL : RE_EOL, 0, 0);
+      break;
+    case RN_CAT:
+      k = regexLeaves(ps, n, RN_CAT, &leaves);
+      for (i = 0; i < k && ps->err == NULL; i++)
+        regexEmit(ps, leaves[rev ? k - 1 - i : i], rev);
+      memFree(leaves);
+      break;
+    case RN_ALT:
+      // a|b|c is split to a, or split to b, or c; all but c jump past c
+      k = regexLeaves(ps, n, RN_ALT, &leaves);
+      jumps = memAlloc(MEM_SEARCH, sizeof(int) * k);
+      for (i = 0; i < k - 1; i++) {
+        l = regexEmitInst(ps, RE_SPLIT, 0, 0);
+        ps->prog[l].x = ps->nprog;
+        regexEmit(ps, leaves[i], rev);
+        jumps[i] = regexEmitInst(ps, RE_JMP, 0, 0);
+        ps->prog[l].y = ps->nprog;
+      }
+      regexEmit(ps, leaves[k - 1], rev);
+      for (i = 0; i < k - 1; i++) ps->prog[jumps[i]].x = ps->nprog;
+      memFree(jumps);
+      memFree(leaves);
+      break;
+    case RN_REPEAT:
+      for (i = 0; i < nd->min; i++) regexEmit(ps, nd->a, rev);
+      if (nd->max < 0) {
+        l = regexEmitInst(ps, RE_SPLIT, 0, 0);
+        regexEmit(ps, nd->a, rev);
+        regexEmitInst(ps, RE_JMP, l, 0);
+        ps->prog[l].x = nd->greedy ? l + 1 : ps->nprog;
+        ps->prog[l].y = nd->greedy ? ps->nprog : l + 1;
+        break;
+      }
+      // x{2,4} is xx(x(x)?)?: every optional copy may leave for the end
+      int first = ps->nprog;
+      for (i = nd->min; i < nd->max; i++) {
+        regexEmitInst(ps, RE_SPLIT, 0, 0);
+        regexEmit(ps, nd->a, rev);
+        if (ps->err) return;
+      }
+      for (i = first; i < ps->nprog; i++) {
+        struct regexInst *in = &ps->prog[i];
+        if (in->op != RE_SPLIT || in->x != 0 || in->y != 0) continue;
+        in->x = nd->greedy ? i + 1 : ps->nprog;
+        in->y = nd->greedy ? ps->nprog : i + 1;
+      }
+      break;
+  }
+}
+
+// the only byte of set, or -1
+int regexSetOne(const unsigned char *set) {
+  int c, one = -1;
+  for (c = 0; c < 256; c++) {
+    if (!regexSetHas(set, c)) continue;
+    if (one >= 0) return -1;
+    one = c;
+  }
+  return one;
+}
+
+// find re->must: the longest run of single bytes the top-level
+// concatenation under n spells out
+void regexMust(struct regexParser *ps, int n) {
+  struct regex *re = ps->re;
+  char run[sizeof(re->must)];
+  int *leaves, k = regexLeaves(ps, n, RN_CAT, &leaves);
+  int i, c, len = 0;
+  for (i = 0; i < k; i++) {
+    struct regexNode *nd = &ps->nodes[leaves[i]];
+    if (nd->type == RN_SET && len < (int)sizeof(re->must) &&
+        (c = regexSetOne(re->sets[nd->set])) >= 0) {
+      run[len++] = c;
+      if (len > re->mustlen) {
+        memcpy(re->must, run, len);
+        re->mustlen = len;
+      }
+    } else {
+      len = 0;
+    }
+  }
+  memFree(leaves);
+}
+
+void regexDfaInit(struct regexDfa *d, struct regexParser *ps, int cut) {
+  d->prog = ps->prog;
+  d->nprog = ps->nprog;
+  d->cut = cut;
+  d->tablecap = 256;
+  d->table = memCalloc(MEM_SEARCH, sizeof(struct regexState *) * d->tablecap);
+  d->nstates = 0;
+  d->bytes = 0;
+  d->start[0] = d->start[1] = NULL;
+  d->list = memAlloc(MEM_SEARCH, sizeof(int) * d->nprog);
+  d->stack = memAlloc(MEM_SEARCH, sizeof(int) * (2 * d->nprog + 2));
+  d->seen = memCalloc(MEM_SEARCH, sizeof(unsigned) * d->nprog);
+  d->mark = 0;
+}
+
+// emit the program of the parsed tree; the forward one starts with a
+// lazy .*, which lets a match start anywhere
+int regexProgram(struct regexParser *ps, int root, int rev) {
+  ps->prog = NULL;
+  ps->nprog = ps->progcap = 0;
+  if (!rev) {
+    int any = regexSetNew(ps->re);
+    regexSetAdd(ps->re->sets[any], 0, 255);
+    regexEmitInst(ps, RE_SPLIT, 3, 1);
+    regexEmitInst(ps, RE_BYTE, any, 0);
+    regexEmitInst(ps, RE_JMP, 0, 0);
+  }
+  regexEmit(ps, root, rev);
+  regexEmitInst(ps, RE_MATCH, 0, 0);
+  if (ps->err == NULL) return 1;
+  memFree(ps->prog);
+  return 0;
+}
+
+// split the bytes into classes that no set tells apart
+void regexClasses(struct regex *re) {
+  int i, c;
+  memset(re->cls, 0, sizeof(re->cls));
+  re->ncls = 1;
+  for (i = 0; i < re->nsets; i++) {
+    int map[512], n = 0;
+    for (c = 0; c < 512; c++) map[c] = -1;
+    for (c = 0; c < 256; c++) {
+      int key = re->cls[c] * 2 + (regexSetHas(re->sets[i], c) != 0);
+      if (map[key] < 0) map[key] = n++;
+      re->cls[c] = map[key];
+    }
+    re->ncls = n;
+  }
+  for (c = 255; c >= 0; c--) re->rep[re->cls[c]] = c;
+}
+
+void regexDfaFlush(struct regexDfa *d) {
+  int i;
+  for (i = 0; i < d->tablecap; i++) {
+    memFree(d->table[i]);
+    d->table[i] = NULL;
+  }
+  d->nstates = 0;
+  d->bytes = 0;
+  d->start[0] = d->start[1] = NULL;
+}
+
+void regexDfaFree(struct regexDfa *d) {
+  regexDfaFlush(d);
+  memFree(d->table);
+  memFree(d->prog);
+  memFree(d->list);
+  memFree(d->stack);
+  memFree(d->seen);
+}
+
+void regexFree(struct regex *re) {
+  if (re == NULL) return;
+  regexDfaFree(&re->fwd);
+  regexDfaFree(&re->rev);
+  memFree(re->sets);
+  memFree(re);
+}
+
+// compile len bytes of pat; NULL with *err set if they are not a regex
+struct regex *regexCompile(const char *pat, int len, const char **err) {
+  struct regex *re = memCalloc(MEM_SEARCH, sizeof(struct regex));
+  struct regexParser ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.p = pat;
+  ps.end = pat + len;
+  ps.re = re;
+  int root = regexParseAlt(&ps);
+  if (root >= 0 && ps.p < ps.end) ps.err = "unmatched )";
+  if (root < 0 || ps.err || !regexProgram(&ps, root, 1)) {
+    *err = ps.err;
+    memFree(ps.nodes);
+    memFree(re->sets);
+    memFree(re);
+    return NULL;
+  }
+  struct regexInst *rev = ps.prog;
+  int nrev = ps.nprog;
+  if (!regexProgram(&ps, root, 0)) {
+    *err = ps.err;
+    memFree(rev);
+    memFree(ps.nodes);
+    memFree(re->sets);
+    memFree(re);
+    return NULL;
+  }
+  regexMust(&ps, root);
+  memFree(ps.nodes);
+  regexDfaInit(&re->fwd, &ps, 1);
+  ps.prog = rev;
+  ps.nprog = nrev;
+  regexDfaInit(&re->rev, &ps, 0);
+  regexClasses(re);
+  return re;
+}
+
+// append the threads reachable from pc without reading a byte to d->list,
+// in priority order. bol - ^ holds here; eol - so does $, otherwise RE_EOL
+// threads are kept to be tried where the line ends. Returns whether a
+// match was reached; a cutting DFA stops adding threads there
+int regexClosure(struct regexDfa *d, int pc, int bol, int eol, int *n) {
+  int sp = 0, found = 0;
+  d->stack[sp++] = pc;
+  while (sp > 0) {
+    pc = d->stack[--sp];
+    if (d->seen[pc] == d->mark) continue;
+    d->seen[pc] = d->mark;
+    struct regexInst *in = &d->prog[pc];
+    switch (in->op) {
+      case RE_JMP:
+        d->stack[sp++] = in->x;
+        break;
+      case RE_SPLIT:
+        d->stack[sp++] = in->y;
+        d->stack[sp++] = in->x;
+        break;
+      case RE_BOL:
+        if (bol) d->stack[sp++] = pc + 1;
+        break;
+      case RE_EOL:
+        if (eol)
+          d->stack[sp++] = pc + 1;
+        else
+          d->list[(*n)++] = pc;
+        break;
+      case RE_MATCH:
+        d->list[(*n)++] = pc;
+        found = 1;
+        if (d->cut) return 1;
+        break;
+      default:
+        d->list[(*n)++] = pc;
+    }
+  }
+  return found;
+}
+
+unsigned regexHash(const int *pcs, int n) {
+  unsigned h = 2166136261u;
+  int i;
+  for (i = 0; i < n; i++) h = (h ^ (unsigned)pcs[i]) * 16777619u;
+  return h;
+}
+
+// the state for the n threads in d->list, made if it is new
+struct regexState *regexIntern(struct regex *re, struct regexDfa *d, int n) {
+  unsigned h = regexHash(d->list, n);
+  unsigned mask = d->tablecap - 1, i = h & mask;
+  struct regexState *st;
+  while ((st = d->table[i]) != NULL) {
+    if (st->hash == h && st->n == n &&
+        !memcmp(st->pcs, d->list, sizeof(int) * n))
+      return st;
+    i = (i + 1) & mask;
+  }
+  size_t size = sizeof(struct regexState) +
+                sizeof(struct regexState *) * re->ncls + sizeof(int) * n;
+  st = memCalloc(MEM_SEARCH, size);
+  st->pcs = (int *)&st->next[re->ncls];
+  st->n = n;
+  st->hash = h;
+  memcpy(st->pcs, d->list, sizeof(int) * n);
+  d->table[i] = st;
+  d->bytes += size;
+  d->nstates++;
+
+  int k, m = 0;
+  if (n == 0) st->flags = RS_DEAD;
+  d->mark++;
+  for (k = 0; k < n; k++) {
+    int op = d->prog[st->pcs[k]].op;
+    if (op == RE_MATCH) st->flags |= RS_MATCH | RS_EOLMATCH;
+    if (op == RE_EOL && !(st->flags & RS_EOLMATCH) &&
+        regexClosure(d, st->pcs[k] + 1, 0, 1, &m))
+      st->flags |= RS_EOLMATCH;
+  }
+
+  if (d->nstates * 2 > d->tablecap) {
+    struct regexState **old = d->table;
+    int oldcap = d->tablecap;
+    d->tablecap *= 2;
+    d->table =
+        memCalloc(MEM_SEARCH, sizeof(struct regexState *) * d->tablecap);
+    for (k = 0; k < oldcap; k++) {
+      if (old[k] == NULL) continue;
+      i = old[k]->hash & (d->tablecap - 1);
+      while (d->table[i]) i = (i + 1) & (d->tablecap - 1);
+      d->table[i] = old[k];
+    }
+    memFree(old);
+  }
+  return st;
+}
+
+struct regexState *regexStart(struct regex *re, struct regexDfa *d, int bol) {
+  if (d->start[bol] == NULL) {
+    int n = 0;
+    d->mark++;
+    regexClosure(d, 0, bol, 0, &n);
+    d->start[bol] = regexIntern(re, d, n);
+  }
+  return d->start[bol];
+}
+
+// the state after reading a byte of class c in st. Once the cache is full
+// every state is dropped, st included, and the scan carries on from the
+// new one, so memory stays bounded and the cost is only rebuilding
+struct regexState *regexStep(struct regex *re, struct regexDfa *d,
+                             struct regexState *st, int c) {
+  int b = re->rep[c];
+  int i, n = 0;
+  d->mark++;
+  for (i = 0; i < st->n; i++) {
+    struct regexInst *in = &d->prog[st->pcs[i]];
+    if (in->op != RE_BYTE || !regexSetHas(re->sets[in->x], b)) continue;
+    if (regexClosure(d, st->pcs[i] + 1, 0, 0, &n) && d->cut) break;
+  }
+  if (d->bytes > MICRO_REGEX_CACHE) {
+    regexDfaFlush(d);
+    return regexIntern(re, d, n);
+  }
+  st->next[c] = regexIntern(re, d, n);
+  return st->next[c];
+}
+
+// end of the leftmost match that starts in s[from, len), or -1; s is a
+// whole line, so ^ holds at 0 and $ at len
+int regexForward(struct regex *re, const char *s, int from, int len) {
+  struct regexDfa *d = &re->fwd;
+  struct regexState *st = regexStart(re, d, from == 0);
+  int i, last = -1;
+  for (i = from; i < len; i++) {
+    if (st->flags) {
+      if (st->flags & RS_DEAD) return last;
+      if (st->flags & RS_MATCH) last = i;
+    }
+    int c = re->cls[(unsigned char)s[i]];
+    struct regexState *next = st->next[c];
+    st = next ? next : regexStep(re, d, st, c);
+  }
+  if (st->flags & RS_EOLMATCH) last = len;
+  return last;
+}
+
+// start of the longest match of the reversed program read back from end
+// down to from, or -1; this is where the match regexForward ended at end
+// begins
+int regexReverse(struct regex *re, const char *s, int from, int end,
+                 int len) {
+  struct regexDfa *d = &re->rev;
+  struct regexState *st = regexStart(re, d, end == len);
+  int i, best = -1;
+  for (i = end; i > from; i--) {
+    if (st->flags & RS_DEAD) return best;
+    if (st->flags & RS_MATCH) best = i;
+    int c = re->cls[(unsigned char)s[i - 1]];
+    struct regexState *next = st->next[c];
+    st = next ? next : regexStep(re, d, st, c);
+  }
+  if (st->flags & (from == 0 ? RS_EOLMATCH : RS_MATCH)) best = from;
+  return best;
+}
+
+/*** search ***/
+
+void searcherInit(struct searcher *s, const char *needle, int len) {
+  s->needle = needle;
+  s->len = len;
+  int i;
+  for (i = 0; i < 256; i++) s->skip[i] = len;
+  for (i = 0; i < len - 1; i++) s->skip[(unsigned char)needle[i]] = len - 1 - i;
+#ifdef MICRO_SEARCH_SIMD
+  s->avx2 = __builtin_cpu_supports("avx2");
+#else
+  s->avx2 = 0;
+#endif
+}
+
+// Boyer-Moore-Horspool; also finishes the tails the vector loops leave
+const char *searchHorspool(const struct searcher *s, const char *p,
+                           const char *end) {
+  int last = s->len - 1;
+  unsigned char lastc = s->needle[last];
+  while (end - p > last) {
+    unsigned char c = p[last];
+    if (c == lastc && !memcmp(p, s->needle, last)) return p;
+    p += s->skip[c];
+  }
+  return NULL;
+}
+
+#ifdef MICRO_SEARCH_SIMD
+// compare the first and last needle byte against 16 positions at once and
+// only memcmp where both agree
+const char *searchSSE2(const struct searcher *s, const char *p,
+                       const char *end) {
+  const __m128i first = _mm_set1_epi8(s->needle[0]);
+  const __m128i last = _mm_set1_epi8(s->needle[s->len - 1]);
+  while (end - p >= s->len - 1 + 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + s->len - 1));
+    unsigned int mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(p + bit + 1, s->needle + 1, s->len - 2)) return p + bit;
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+  return searchHorspool(s, p, end);
+}
+
+__attribute__((target("avx2"))) const char *searchAVX2(
+    const struct searcher *s, const char *p, const char *end) {
+  const __m256i first = _mm256_set1_epi8(s->needle[0]);
+  const __m256i last = _mm256_set1_epi8(s->needle[s->len - 1]);
+  while (end - p >= s->len - 1 + 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)p);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(p + s->len - 1));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (!memcmp(p + bit + 1, s->needle + 1, s->len - 2)) return p + bit;
+      mask &= mask - 1;
+    }
+    p += 32;
+  }
+  return searchHorspool(s, p, end);
+}
+#endif
+
+// first occurrence of the needle in [p, end), or NULL
+const char *searchFind(const struct searcher *s, const char *p,
+                       const char *end) {
+  if (s->len == 0 || end - p < s->len) return NULL;
+  if (s->len == 1) return memchr(p, s->needle[0], end - p);
+#ifdef MICRO_SEARCH_SIMD
+  if (s->avx2) return searchAVX2(s, p, end);
+  return searchSSE2(s, p, end);
+#else
+  return searchHorspool(s, p, end);
+#endif
+}
+
+void searchMatchesAdd(struct searchMatches *r, int row, int col, int len,
+                      const char *p, int avail) {
+  if (r->n == r->cap) {
+    r->cap = r->cap ? r->cap * 2 : 64;
+    r->m = memRealloc(MEM_SEARCH, r->m, sizeof(struct searchMatch) * r->cap);
+  }
+  struct searchMatch *m = &r->m[r->n++];
+  m->row = row;
+  m->col = col;
+  m->len = len;
+  m->p = p;
+  m->avail = avail;
+}
+
+// find every match of the needle in one piece, in order; spans are scanned
+// in place, without opening their lines
+void searchPieceScan(const struct searcher *s, const struct searchPiece *pc,
+                     struct searchMatches *out) {
+  const char *end = pc->chars + pc->size;
+  const char *p = pc->chars;
+  const char *m;
+  if (!pc->span) {
+    while ((m = searchFind(s, p, end)) != NULL) {
+      searchMatchesAdd(out, pc->line, m - pc->chars, s->len, m, end - m);
+      p = m + 1;
+    }
+    return;
+  }
+  // the query holds no control characters, so a match never crosses a line
+  // end; line numbers are counted up to each match as it comes
+  int line = pc->line;
+  const char *ls = pc->chars;
+  const char *le = NULL;
+  while ((m = searchFind(s, p, end)) != NULL) {
+    const char *nl;
+    while ((nl = memchr(ls, '\n', m - ls)) != NULL) {
+      line++;
+      ls = nl + 1;
+      le = NULL;
+    }
+    if (le == NULL) {
+      le = memchr(m, '\n', end - m);
+      if (le == NULL) le = end;
+      while (le > m && le[-1] == '\r') le--;
+    }
+    if (m + s->len <= le)
+      searchMatchesAdd(out, line, m - ls, s->len, m, le - m);
+    p = m + 1;
+  }
+}
+
+// find every match of re in one line, in order; matches do not overlap
+// and empty ones are skipped
+void regexLineScan(struct regex *re, int line, const char *s, int len,
+                   struct searchMatches *out) {
+  int from = 0;
+  while (from <= len) {
+    int end = regexForward(re, s, from, len);
+    if (end < 0) break;
+    int start = regexReverse(re, s, from, end, len);
+    if (start < 0) start = end;
+    if (end > start) {
+      searchMatchesAdd(out, line, start, end - start, s + start, len - start);
+      from = end;
+    } else {
+      from = start + 1;
+    }
+  }
+}
+
+// searchPieceScan for a regex: a span is scanned line by line in place.
+// must, if not NULL, finds re->must, and only lines holding it are scanned
+void regexPieceScan(struct regex *re, const struct searcher *must,
+                    const struct searchPiece *pc, struct searchMatches *out) {
+  const char *end = pc->chars + pc->size;
+  const char *ls = pc->chars;
+  int line = pc->line;
+  if (!pc->span) {
+    if (must == NULL || searchFind(must, ls, end))
+      regexLineScan(re, line, ls, pc->size, out);
+    return;
+  }
+  while (ls < end) {
+    const char *nl;
+    if (must) {
+      const char *m = searchFind(must, ls, end);
+      if (m == NULL) return;
+      while ((nl = memchr(ls, '\n', m - ls)) != NULL) {
+        line++;
+        ls = nl + 1;
+      }
+    }
+    nl = memchr(ls, '\n', end - ls);
+    const char *le = nl ? nl : end;
+    const char *te = le;
+    while (te > ls && te[-1] == '\r') te--;
+    regexLineScan(re, line++, ls, te - ls, out);
+    ls = le + 1;
+  }
+}
+
+// hand what the worker found so far to the main thread; false once a newer
+// job made the scan stale
+int editorSearchFlush(unsigned gen, struct searchMatches *found, int done) {
+  struct editorSearch *sr = &E.search;
+  int i;
+  pthread_mutex_lock(&sr->lock);
+  int live = sr->gen == gen;
+  if (live) {
+    for (i = 0; i < found->n; i++) {
+      struct searchMatch *m = &found->m[i];
+      searchMatchesAdd(&sr->res, m->row, m->col, m->len, m->p, m->avail);
+    }
+    sr->done = done;
+    write(sr->notify[1], "", 1);
+  }
+  pthread_mutex_unlock(&sr->lock);
+  found->n = 0;
+  return live;
 }
 
-void editorInsertNewline() {
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+void editorSearchRun(const char *query, int len, int regex, unsigned gen) {
+  struct editorSearch *sr = &E.search;
+  struct searcher s;
+  struct searchMatches found = {NULL, 0, 0};
+  struct regex *re = NULL;
+  size_t scanned = 0;
+  int i;
+  searcherInit(&s, query, len);
+  // like grep, a pattern without special characters is a plain string
+  if (regex && strpbrk(query, "\\^$.|?*+()[]{}")) {
+    const char *err = NULL;
+    re = regexCompile(query, len, &err);
+    if (re == NULL) {
+      pthread_mutex_lock(&sr->lock);
+      if (sr->gen == gen) {
+        sr->error = err;
+        sr->done = 1;
+        write(sr->notify[1], "", 1);
+      }
+      pthread_mutex_unlock(&sr->lock);
+      return;
+    }
+    // one byte is too common to be worth looking for first
+    if (re->mustlen >= 2) searcherInit(&s, re->must, re->mustlen);
   }
-  E.cy++;
-  E.cx = 0;
+  for (i = 0; i < sr->npieces; i++) {
+    if (re)
+      regexPieceScan(re, re->mustlen >= 2 ? &s : NULL, &sr->pieces[i],
+                     &found);
+    else
+      searchPieceScan(&s, &sr->pieces[i], &found);
+    scanned += sr->pieces[i].size;
+    // stream results back about every megabyte
+    if (scanned >= (1 << 20) || found.n >= 4096) {
+      scanned = 0;
+      if (!editorSearchFlush(gen, &found, 0)) break;
+    }
+  }
+  if (i == sr->npieces) editorSearchFlush(gen, &found, 1);
+  memFree(found.m);
+  regexFree(re);
 }
 
-void editorDelChar() {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
-
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+void *editorSearchWorker(void *arg) {
+  struct editorSearch *sr = &E.search;
+  (void)arg;
+  pthread_mutex_lock(&sr->lock);
+  while (1) {
+    while (sr->job == NULL) pthread_cond_wait(&sr->wake, &sr->lock);
+    char *query = sr->job;
+    int len = sr->joblen;
+    int regex = sr->jobregex;
+    unsigned gen = sr->gen;
+    sr->job = NULL;
+    sr->busy = 1;
+    pthread_mutex_unlock(&sr->lock);
+
+    editorSearchRun(query, len, regex, gen);
+    memFree(query);
+
+    pthread_mutex_lock(&sr->lock);
+    sr->busy = 0;
+    pthread_cond_broadcast(&sr->idle);
   }
+  return NULL;
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
-  for (j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+// snapshot the document for the worker; nothing is edited while the search
+// prompt is open, so the text the pieces point at stays put
+void editorSearchBegin() {
+  struct editorSearch *sr = &E.search;
+  int at = 0;
+  int cap = 64;
+  erow *row;
+  sr->pieces = memAlloc(MEM_SEARCH, sizeof(struct searchPiece) * cap);
+  sr->npieces = 0;
+  for (row = editorRowFirst(); row; row = editorRowNext(row)) {
+    if (sr->npieces == cap) {
+      cap *= 2;
+      sr->pieces =
+          memRealloc(MEM_SEARCH, sr->pieces, sizeof(struct searchPiece) * cap);
+    }
+    struct searchPiece *pc = &sr->pieces[sr->npieces++];
+    pc->chars = row->chars;
+    pc->size = row->size;
+    pc->line = at;
+    pc->span = (row->flags & ROW_SPAN) != 0;
+    at += ((rownode *)row)->nlines;
+  }
+  if (!sr->started) {
+    if (pthread_create(&sr->worker, NULL, editorSearchWorker, NULL) != 0)
+      die("pthread_create");
+    sr->started = 1;
   }
-
-  return buf;
 }
 
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
-
-  editorSelectSyntaxHighlight();
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+// queue a scan for query, dropping whatever the worker was doing
+void editorSearchStart(const char *query, int len) {
+  struct editorSearch *sr = &E.search;
+  pthread_mutex_lock(&sr->lock);
+  sr->gen++;
+  memFree(sr->job);
+  sr->job = memStrdup(MEM_SEARCH, query);
+  sr->joblen = len;
+  sr->jobregex = sr->regex;
+  sr->res.n = 0;
+  sr->done = 0;
+  sr->error = NULL;
+  pthread_cond_signal(&sr->wake);
+  pthread_mutex_unlock(&sr->lock);
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// wait up to ms for the worker to finish, so small files feel synchronous;
+// forever if ms is negative
+void editorSearchWait(int ms) {
+  struct editorSearch *sr = &E.search;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += ms * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  pthread_mutex_lock(&sr->lock);
+  if (ms < 0) {
+    while (!sr->done) pthread_cond_wait(&sr->idle, &sr->lock);
+  }
+  while (!sr->done &&
+         pthread_cond_timedwait(&sr->idle, &sr->lock, &deadline) == 0)
+    ;
+  pthread_mutex_unlock(&sr->lock);
 }
 
-void editorSave() {
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// the query grew from a prefix that was already searched: every new match
+// is an old match that continues with the added bytes; false if the scan
+// for the prefix never finished
+int editorSearchNarrow(const char *query, int len) {
+  struct searchMatches *r = &E.search.res;
+  int i, n = 0;
+  pthread_mutex_lock(&E.search.lock);
+  if (!E.search.done) {
+    pthread_mutex_unlock(&E.search.lock);
+    return 0;
+  }
+  for (i = 0; i < r->n; i++) {
+    struct searchMatch *m = &r->m[i];
+    if (m->avail >= len && !memcmp(m->p, query, len)) {
+      r->m[n] = *m;
+      r->m[n++].len = len;
     }
-    editorSelectSyntaxHighlight();
   }
+  r->n = n;
+  pthread_mutex_unlock(&E.search.lock);
+  return 1;
+}
 
-  int len;
-  char *buf = editorRowsToString(&len);
-
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
+// index of the first match at or after (row, col); call with lock held
+int editorSearchIndex(int row, int col) {
+  struct searchMatches *r = &E.search.res;
+  int lo = 0, hi = r->n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    struct searchMatch *m = &r->m[mid];
+    if (m->row < row || (m->row == row && m->col < col))
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  return lo;
+}
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// stop the worker and forget the results
+void editorSearchReset() {
+  struct editorSearch *sr = &E.search;
+  pthread_mutex_lock(&sr->lock);
+  sr->gen++;
+  memFree(sr->job);
+  sr->job = NULL;
+  while (sr->busy) pthread_cond_wait(&sr->idle, &sr->lock);
+  memFree(sr->res.m);
+  sr->res.m = NULL;
+  sr->res.n = sr->res.cap = 0;
+  sr->done = 0;
+  sr->error = NULL;
+  pthread_mutex_unlock(&sr->lock);
+  memFree(sr->query);
+  sr->query = NULL;
+  sr->qlen = 0;
+  sr->cur = -1;
+}
+
+// done with the prompt: release the snapshot too
+void editorSearchEnd() {
+  struct editorSearch *sr = &E.search;
+  editorSearchReset();
+  memFree(sr->pieces);
+  sr->pieces = NULL;
+  sr->npieces = 0;
 }
 
 /*** find ***/
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+void editorFindJump(int i) {
+  struct editorSearch *sr = &E.search;
+  struct searchMatch *m = &sr->res.m[i];
+  sr->cur = i;
+  E.cy = m->row;
+  E.cx = m->col;
+  E.rowoff = E.numrows;
+
+  // a regex match is as wide as the columns its bytes render to
+  erow *row = editorRowAt(m->row);
+  E.match_row = m->row;
+  E.match_col = editorRowCxToRx(row, m->col);
+  E.match_len = editorRowCxToRx(row, m->col + m->len) - E.match_col;
+}
+
+// pick up results the worker streamed in while the prompt waited for keys;
+// returns whether the screen needs redrawing
+int editorFindPoll() {
+  struct editorSearch *sr = &E.search;
+  static int shown = -1, shown_done = -1;
+  if (sr->pieces == NULL) return 0;
+  pthread_mutex_lock(&sr->lock);
+  int changed = sr->res.n != shown || sr->done != shown_done;
+  shown = sr->res.n;
+  shown_done = sr->done;
+  if (sr->cur == -1 && sr->res.n > 0) editorFindJump(0);
+  pthread_mutex_unlock(&sr->lock);
+  return changed;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+// n with thousands separators: 10482 -> "10,482"
+void formatCount(char *buf, int n) {
+  char digits[16];
+  int len = snprintf(digits, sizeof(digits), "%d", n);
+  int i;
+  for (i = 0; i < len; i++) {
+    *buf++ = digits[i];
+    if (i < len - 1 && (len - 1 - i) % 3 == 0) *buf++ = ',';
+  }
+  *buf = '\0';
+}
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+// "match 37 of 10,482 | " for the status bar; the total is "10,482+" while
+// the worker is still scanning
+void editorFindCounter(char *buf, int size) {
+  struct editorSearch *sr = &E.search;
+  char cur[16], total[16];
+  pthread_mutex_lock(&sr->lock);
+  int n = sr->res.n;
+  int done = sr->done;
+  const char *error = sr->error;
+  pthread_mutex_unlock(&sr->lock);
+  const char *mode = sr->regex ? "regex: " : "";
+  formatCount(total, n);
+  if (error)
+    snprintf(buf, size, "%s%s | ", mode, error);
+  else if (n == 0)
+    snprintf(buf, size, "%s%s | ", mode, done ? "no matches" : "searching");
+  else if (sr->cur == -1)
+    snprintf(buf, size, "%s%s%s matches | ", mode, total, done ? "" : "+");
+  else {
+    formatCount(cur, sr->cur + 1);
+    snprintf(buf, size, "%smatch %s of %s%s | ", mode, cur, total,
+             done ? "" : "+");
   }
+}
+
+void editorFindCallback(char *query, int key) {
+  struct editorSearch *sr = &E.search;
+  int direction = 0;
 
   if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+    E.match_row = -1;
+    editorSearchReset();
     return;
   } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
     direction = 1;
   } else if (key == ARROW_LEFT || key == ARROW_UP) {
     direction = -1;
+  } else if (key == CTRL_KEY('r')) {
+    // forgetting the query makes the search below start over
+    sr->regex = !sr->regex;
+    memFree(sr->query);
+    sr->query = NULL;
   } else {
-    last_match = -1;
-    direction = 1;
+    sr->cur = -1;
   }
 
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1)
-      current = E.numrows - 1;
-    else if (current == E.numrows)
-      current = 0;
-
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+  int len = strlen(query);
+  if (sr->query == NULL || len != sr->qlen || memcmp(query, sr->query, len)) {
+    E.match_row = -1;
+    sr->cur = -1;
+    direction = 0;
+    if (!(!sr->regex && sr->query && sr->qlen > 0 && len > sr->qlen &&
+          !memcmp(query, sr->query, sr->qlen) &&
+          editorSearchNarrow(query, len))) {
+      editorSearchStart(query, len);
+      // a scripted run sees every scan through, so it is repeatable
+      editorSearchWait(E.headless ? -1 : 10);
     }
+    memFree(sr->query);
+    sr->query = memStrdup(MEM_SEARCH, query);
+    sr->qlen = len;
+  }
+
+  pthread_mutex_lock(&sr->lock);
+  int n = sr->res.n;
+  if (n > 0 && sr->cur == -1) {
+    editorFindJump(0);
+  } else if (n > 0 && direction != 0) {
+    // step from the cursor through the sorted index; the ends only wrap
+    // around once the scan is complete
+    int i = editorSearchIndex(E.cy, E.cx + (direction > 0)) -
+            (direction < 0);
+    if (i < 0 && sr->done) i = n - 1;
+    if (i >= n && sr->done) i = 0;
+    if (i >= 0 && i < n) editorFindJump(i);
   }
+  pthread_mutex_unlock(&sr->lock);
 }
 
 void editorFind() {
@@ -797,11 +5038,15 @@ void editorFind() {
   int saved_coloff = E.coloff;
   int saved_rowoff = E.rowoff;
 
-  char *query =
-      editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  editorSearchReset();
+  editorSearchBegin();
+  E.search.regex = 0;
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, ^R regex)",
+                             editorFindCallback);
+  editorSearchEnd();
 
   if (query) {
-    free(query);
+    memFree(query);
   } else {
     E.cx = saved_cx;
     E.cy = saved_cy;
@@ -810,33 +5055,299 @@ void editorFind() {
   }
 }
 
+/*** goto ***/
+
+// jump to a line number, a percentage through the file ("N%") or a byte
+// offset ("@N"); each is one walk down the row tree
+void editorGoto() {
+  char *query = editorPrompt("Go to: %s (line, N%% or @offset)", NULL);
+  if (query == NULL) return;
+
+  int byte = query[0] == '@';
+  char *end;
+  long long n = strtoll(query + byte, &end, 10);
+  int percent = !byte && strcmp(end, "%") == 0;
+  if (end == query + byte || (*end && !percent) || n < 0) {
+    editorSetStatusMessage("Not a position: %s", query);
+    memFree(query);
+    return;
+  }
+  memFree(query);
+
+  int col = 0;
+  if (byte) {
+    E.cy = editorRowAtOffset(n, &col);
+  } else if (percent) {
+    if (n > 100) n = 100;
+    E.cy = editorRowAtOffset(rowTreeBytes(E.rows) * n / 100, &col);
+    col = 0;
+  } else {
+    E.cy = n > E.numrows ? E.numrows : n > 0 ? n - 1 : 0;
+  }
+  E.cx = col;
+  // bring the line to the top of the screen, as a search match is
+  E.rowoff = E.numrows;
+}
+
+/*** commands ***/
+
+// Ctrl-E: run a command typed at the prompt
+void editorCommand() {
+  char *line =
+      editorPrompt("Command: %s (mem, profile [dump FILE | reset])", NULL);
+  if (line == NULL) return;
+
+  char *argv[4];
+  int argc = 0;
+  char *tok = strtok(line, " ");
+  while (tok && argc < 4) {
+    argv[argc++] = tok;
+    tok = strtok(NULL, " ");
+  }
+
+  if (argc == 0) {
+    // only spaces
+  } else if (strcmp(argv[0], "mem") == 0 && argc == 1) {
+    char summary[sizeof(E.statusmsg)];
+    memSummary(summary, sizeof(summary));
+    editorSetStatusMessage("%s", summary);
+  } else if (strcmp(argv[0], "profile") == 0 && argc == 1) {
+    E.prof.overlay = !E.prof.overlay;
+  } else if (strcmp(argv[0], "profile") == 0 && argc == 2 &&
+             strcmp(argv[1], "reset") == 0) {
+    memset(E.prof.hist, 0, sizeof(E.prof.hist));
+    editorSetStatusMessage("Profile cleared");
+  } else if (strcmp(argv[0], "profile") == 0 && argc <= 3 &&
+             strcmp(argv[1], "dump") == 0) {
+    const char *file = argc == 3 ? argv[2] : "micro-profile.txt";
+    if (profDump(file) == 0)
+      editorSetStatusMessage("Profile written to %s", file);
+    else
+      editorSetStatusMessage("Can't write %s: %s", file, strerror(errno));
+  } else {
+    editorSetStatusMessage("Unknown command: %s", argv[0]);
+  }
+  memFree(line);
+}
+
 /*** append buffer ***/
 
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
 #define ABUF_INIT \
-  { NULL, 0 }
+  { NULL, 0, 0 }
+
+// room for len more bytes at the end; capacity doubles, so a buffer that is
+// reused across frames stops allocating once it has seen the largest one
+char *abReserve(struct abuf *ab, int len) {
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap * 2 : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    ab->b = memRealloc(MEM_SCREEN, ab->b, cap);
+    ab->cap = cap;
+  }
+  char *p = &ab->b[ab->len];
+  ab->len += len;
+  return p;
+}
 
 void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+  memcpy(abReserve(ab, len), s, len);
+}
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->b = new;
-  ab->len += len;
+void abFree(struct abuf *ab) { memFree(ab->b); }
+
+/*** screen ***/
+
+void screenInvalidate() {
+  int i, n = (E.screenrows + 2) * E.screencols;
+  for (i = 0; i < n; i++) E.shadow[i].attr = ATTR_UNKNOWN;
+  E.term_y = E.term_x = -1;
+}
+
+// size both grids for the current window; the next flush redraws it all
+void screenResize() {
+  int n = (E.screenrows + 2) * E.screencols;
+  E.screen = memRealloc(MEM_SCREEN, E.screen, sizeof(struct cell) * n);
+  E.shadow = memRealloc(MEM_SCREEN, E.shadow, sizeof(struct cell) * n);
+  screenInvalidate();
+}
+
+struct cell *screenRow(int y) { return &E.screen[y * E.screencols]; }
+
+void screenFill(int y, int x, int n, char ch, unsigned char attr) {
+  struct cell *c = screenRow(y);
+  if (x + n > E.screencols) n = E.screencols - x;
+  while (n-- > 0) {
+    c[x].ch = ch;
+    c[x].attr = attr;
+    x++;
+  }
+}
+
+void screenPuts(int y, int x, const char *s, int len, unsigned char attr) {
+  struct cell *c = screenRow(y);
+  if (x + len > E.screencols) len = E.screencols - x;
+  while (len-- > 0) {
+    c[x].ch = *s++;
+    c[x].attr = attr;
+    x++;
+  }
+}
+
+// the escape that switches the terminal to each attribute, built once
+struct sgr {
+  char seq[12];
+  int len;
+} screen_sgr[256];
+
+void screenInitAttrs() {
+  int attr;
+  for (attr = 0; attr < 256; attr++) {
+    struct sgr *s = &screen_sgr[attr];
+    int hl = attr & ~ATTR_INVERSE;
+    if (attr == HL_NORMAL) {
+      s->len = snprintf(s->seq, sizeof(s->seq), "\x1b[m");
+    } else if (hl == HL_NORMAL) {
+      s->len = snprintf(s->seq, sizeof(s->seq), "\x1b[0;7m");
+    } else {
+      s->len = snprintf(s->seq, sizeof(s->seq), "\x1b[0%s;%dm",
+                        attr & ATTR_INVERSE ? ";7" : "",
+                        editorSyntaxToColor(hl));
+    }
+  }
+}
+
+void screenSetAttr(struct abuf *ab, int *cur, int attr) {
+  if (*cur == attr) return;
+  abAppend(ab, screen_sgr[attr].seq, screen_sgr[attr].len);
+  *cur = attr;
+}
+
+// move the terminal cursor to (y, x) as cheaply as we know how: a carriage
+// return, a newline, a short stretch of cells that are already on screen, a
+// relative step, or an absolute position
+void screenMove(struct abuf *ab, int y, int x, int *attr) {
+  int ty = E.term_y, tx = E.term_x;
+  if (ty == y && tx == x) return;
+  if (ty == y && x == 0) {
+    abAppend(ab, "\r", 1);
+  } else if (ty != -1 && ty + 1 == y && x == 0) {
+    abAppend(ab, "\r\n", 2);
+  } else if (ty == y && tx != -1 && x > tx) {
+    struct cell *c = screenRow(y);
+    int i = tx;
+    if (x - tx <= 4)
+      while (i < x && c[i].attr == *attr) i++;
+    if (i == x) {
+      for (i = tx; i < x; i++) abAppend(ab, &c[i].ch, 1);
+    } else {
+      char buf[16];
+      int len = snprintf(buf, sizeof(buf), "\x1b[%dC", x - tx);
+      abAppend(ab, buf, len);
+    }
+  } else {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+  }
+  E.term_y = y;
+  E.term_x = x;
+}
+
+int cellsEqual(const struct cell *a, const struct cell *b) {
+  return a->ch == b->ch && a->attr == b->attr;
+}
+
+int cellBlank(const struct cell *c) {
+  return c->ch == ' ' && c->attr == HL_NORMAL;
 }
 
-void abFree(struct abuf *ab) { free(ab->b); }
+// send the difference between the drawn frame and the shadow, then leave the
+// cursor at (cy, cx); a frame with no changes sends nothing at all
+void screenFlush(struct abuf *ab, int cy, int cx) {
+  int rows = E.screenrows + 2, cols = E.screencols;
+  int attr = HL_NORMAL;
+  int hidden = 0;
+  int y, x;
+  for (y = 0; y < rows; y++) {
+    struct cell *n = screenRow(y);
+    struct cell *o = &E.shadow[y * cols];
+    int from = 0, to = cols - 1;
+    while (from < cols && cellsEqual(&n[from], &o[from])) from++;
+    if (from == cols) continue;
+    while (cellsEqual(&n[to], &o[to])) to--;
+    // bytes of a multibyte character do not map to one column each, so
+    // such rows are always sent whole from the left edge
+    int wide = 0;
+    for (x = 0; x < cols && !wide; x++)
+      wide = (unsigned char)n[x].ch >= 0x80 ||
+             ((unsigned char)o[x].ch >= 0x80 && o[x].attr != ATTR_UNKNOWN);
+    if (wide) {
+      from = 0;
+      to = cols - 1;
+    }
+    // past the last non-blank cell, a single erase covers the rest
+    int end = cols;
+    while (end > from && cellBlank(&n[end - 1])) end--;
+    int erase = to >= end;
+    if (erase) to = end - 1;
+
+    if (!hidden) {
+      abAppend(ab, "\x1b[?25l", 6);
+      hidden = 1;
+    }
+    if (wide) screenMove(ab, y, 0, &attr);
+    x = from;
+    while (x <= to) {
+      if (!wide && cellsEqual(&n[x], &o[x])) {
+        x++;
+        continue;
+      }
+      // send a run of one attribute in one go; a few unchanged cells inside
+      // it cost less to send again than to step over
+      int a = n[x].attr;
+      int last = x, k;
+      for (k = x + 1; k <= to && n[k].attr == a && k - last <= 4; k++)
+        if (wide || !cellsEqual(&n[k], &o[k])) last = k;
+      if (!wide) screenMove(ab, y, x, &attr);
+      screenSetAttr(ab, &attr, a);
+      char *p = abReserve(ab, last - x + 1);
+      for (k = x; k <= last; k++) *p++ = n[k].ch;
+      x = last + 1;
+      E.term_x = x < cols ? x : -1;
+    }
+    if (erase) {
+      if (!wide) screenMove(ab, y, end, &attr);
+      screenSetAttr(ab, &attr, HL_NORMAL);
+      abAppend(ab, "\x1b[K", 3);
+    }
+    if (wide) E.term_x = -1;
+    memcpy(o, n, sizeof(struct cell) * cols);
+  }
+  screenSetAttr(ab, &attr, HL_NORMAL);
+  if (E.term_y != cy || E.term_x != cx) {
+    if (!hidden) abAppend(ab, "\x1b[?25l", 6);
+    hidden = 1;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy + 1, cx + 1);
+    abAppend(ab, buf, len);
+    E.term_y = cy;
+    E.term_x = cx;
+  }
+  if (hidden) abAppend(ab, "\x1b[?25h", 6);
+}
 
 /*** output ***/
 
 void editorScroll() {
   E.rx = 0;
   if (E.cy < E.numrows) {
-    E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+    E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
   }
 
   if (E.cy < E.rowoff) {
@@ -853,145 +5364,210 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows() {
   int y;
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rowoff;
-    if (filerow >= E.numrows) {
+    erow *row = editorRowAt(filerow);
+    screenFill(y, 0, E.screencols, ' ', HL_NORMAL);
+    if (row == NULL) {
       if (E.numrows == 0 && y == E.screenrows / 3) {
         char welcome[80];
         int welcomelen = snprintf(welcome, sizeof(welcome),
                                   "MICRO editor -- version %s", MICRO_VERSION);
         if (welcomelen > E.screencols) welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2;
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-        while (padding--) abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+        if (padding) screenPuts(y, 0, "~", 1, HL_NORMAL);
+        screenPuts(y, padding, welcome, welcomelen, HL_NORMAL);
       } else {
-        abAppend(ab, "~", 1);
+        screenPuts(y, 0, "~", 1, HL_NORMAL);
       }
     } else {
-      int len = E.row[filerow].rsize - E.coloff;
+      editorRowCache(row);
+      // skip - columns of render left of the screen
+      int skip = E.coloff - (row->win ? row->win->col : 0);
+      int len = row->rsize - skip;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      char *c = &E.row[filerow].render[E.coloff];
-      unsigned char *hl = &E.row[filerow].hl[E.coloff];
-      int current_color = -1;
+      char *c = &row->render[skip];
+      // run - the highlight run holding column at
+      unsigned char *run = row->hl;
+      int at = 0;
+      struct cell *cell = screenRow(y);
       int j;
       for (j = 0; j < len; j++) {
+        while (at + run[0] <= skip + j) {
+          at += run[0];
+          run += 2;
+        }
+        unsigned char h = run[1];
+        if (filerow == E.match_row && E.coloff + j >= E.match_col &&
+            E.coloff + j < E.match_col + E.match_len)
+          h = HL_MATCH;
         if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
+          cell[j].ch = (c[j] <= 26) ? '@' + c[j] : '?';
+          cell[j].attr = ATTR_INVERSE;
         } else {
-          int color = editorSyntaxToColor(hl[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
-          abAppend(ab, &c[j], 1);
+          cell[j].ch = c[j];
+          cell[j].attr = h;
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
     }
-
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+  int y = E.screenrows;
   char status[80], rstatus[80];
   int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                      E.filename ? E.filename : "[No Name]", E.numrows,
                      E.dirty ? "(modified)" : "");
-  int rlen =
-      snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-               E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
+  char counter[48] = "";
+  if (E.search.query) editorFindCounter(counter, sizeof(counter));
+  long long total = rowTreeBytes(E.rows);
+  long long off = total;
+  if (E.cy < E.numrows) off = editorRowOffset(editorRowAt(E.cy)) + E.cx;
+  int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d/%d | %lldB %d%%",
+                      counter, E.syntax ? E.syntax->filetype : "no ft",
+                      E.cy + 1, E.numrows, off,
+                      total ? (int)(off * 100 / total) : 0);
   if (len > E.screencols) len = E.screencols;
-  abAppend(ab, status, len);
-  while (len < E.screencols) {
-    if (E.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
+  screenFill(y, 0, E.screencols, ' ', ATTR_INVERSE);
+  screenPuts(y, 0, status, len, ATTR_INVERSE);
+  if (E.screencols - len >= rlen)
+    screenPuts(y, E.screencols - rlen, rstatus, rlen, ATTR_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+  int y = E.screenrows + 1;
+  screenFill(y, 0, E.screencols, ' ', HL_NORMAL);
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols) msglen = E.screencols;
   if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+    screenPuts(y, 0, E.statusmsg, msglen, HL_NORMAL);
+  else
+    msglen = 0;
+
+  // the profile overlay goes on the right, if the message leaves room
+  if (E.prof.overlay) {
+    char overlay[160];
+    profOverlay(overlay, sizeof(overlay));
+    int len = strlen(overlay);
+    int room = E.screencols - (msglen ? msglen + 2 : 0);
+    if (len > room) len = room;
+    if (len > 0)
+      screenPuts(y, E.screencols - len, overlay, len, ATTR_INVERSE);
+  }
 }
 
 void editorRefreshScreen() {
+  long long t = nowNs();
   editorScroll();
+  editorSyntaxSettle(E.rowoff + E.screenrows - 1, NULL);
+  long long t2 = nowNs();
+  profAdd(PROF_SYNTAX, t2 - t);
+
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+
+  // kept across frames, see abReserve
+  static struct abuf ab = ABUF_INIT;
+  ab.len = 0;
+  screenFlush(&ab, E.cy - E.rowoff, E.rx - E.coloff);
+  t = nowNs();
+  profAdd(PROF_DRAW, t - t2);
+  if (E.headless)
+    E.sink += ab.len;
+  else if (ab.len)
+    write(STDOUT_FILENO, ab.b, ab.len);
+  profAdd(PROF_FLUSH, nowNs() - t);
+
+  E.frame_at = nowMs();
+  E.input_depth = inputDepth();
+  profFrame(ab.len);
+  E.frame_keys = 0;
+}
 
-  struct abuf ab = ABUF_INIT;
-
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
-
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
-
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-           (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
-
-  abAppend(&ab, "\x1b[?25h", 6);
-
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+// draw a frame before waiting for more input, but not while keys are still
+// queued: a burst is handled as a whole and drawn once. Frames are kept at
+// least MICRO_FRAME_MS apart, and input arriving meanwhile goes first
+void editorScheduleFrame() {
+  // the view follows every key even when no frame is drawn for it: Page
+  // Up/Down move relative to it
+  editorScroll();
+  long long since = nowMs() - E.frame_at;
+  if (inputDepth() > 0 && since < MICRO_FRAME_STALL_MS) return;
+  if (since < MICRO_FRAME_MS && editorPoll(MICRO_FRAME_MS - since)) return;
+  editorRefreshScreen();
 }
 
+// redraw once the status message has gone stale, so it disappears
+void editorStatusExpire() { editorRefreshScreen(); }
+
 void editorSetStatusMessage(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
   vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
   va_end(ap);
   E.statusmsg_time = time(NULL);
+  editorTimerSet(MICRO_STATUS_MS, editorStatusExpire);
 }
 
 /*** input ***/
 
+// background work done while waiting for a key
+// background work for when no input is waiting; returns whether any is
+// left
+int editorIdle() {
+  // lex ahead of the screen for a bounded slice of time
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += MICRO_LEX_SLICE_MS * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  // the lex threads are going through the file already
+  if (E.lex.running && !E.lex.edited) return 0;
+  long long t = nowNs();
+  int more = editorSyntaxSettle(INT_MAX, &deadline);
+  profAdd(PROF_IDLE, nowNs() - t);
+  return more;
+}
+
+void editorResize(int fd) {
+  editorDrain(fd);
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) return;
+  E.screenrows -= 2;
+  screenResize();
+  editorRefreshScreen();
+}
+void editorWinch(int sig) {
+  int saved_errno = errno;
+  (void)sig;
+  write(E.winch[1], "", 1);
+  errno = saved_errno;
+}
+
+void editorFindNotify(int fd) {
+  editorDrain(fd);
+  if (editorFindPoll()) editorRefreshScreen();
+}
+
 char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   size_t bufsize = 128;
-  char *buf = malloc(bufsize);
+  char *buf = memAlloc(MEM_INPUT, bufsize);
 
   size_t buflen = 0;
   buf[0] = '\0';
+  E.prof.prompts++;
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    // a prompt stays up for as long as it takes
+    editorTimerCancel(editorStatusExpire);
+    editorScheduleFrame();
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -999,7 +5575,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
       if (callback) callback(buf, c);
-      free(buf);
+      memFree(buf);
       return NULL;
     } else if (c == '\r') {
       if (buflen != 0) {
@@ -1007,21 +5583,38 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
         if (callback) callback(buf, c);
         return buf;
       }
+    } else if (c == PASTE_KEY) {
+      // a prompt is one line: keep the printable part of the paste
+      int i;
+      for (i = 0; i < E.pastelen; i++) {
+        unsigned char p = E.paste[i];
+        if (iscntrl(p) || p >= 128) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = memRealloc(MEM_INPUT, buf, bufsize);
+        }
+        buf[buflen++] = p;
+      }
+      buf[buflen] = '\0';
     } else if (!iscntrl(c) && c < 128) {
       if (buflen == bufsize - 1) {
         bufsize *= 2;
-        buf = realloc(buf, bufsize);
+        buf = memRealloc(MEM_INPUT, buf, bufsize);
       }
       buf[buflen++] = c;
       buf[buflen] = '\0';
     }
 
-    if (callback) callback(buf, c);
+    if (callback) {
+      long long t = nowNs();
+      callback(buf, c);
+      profAdd(PROF_EDIT, nowNs() - t);
+    }
   }
 }
 
 void editorMoveCursor(int key) {
-  erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  erow *row = editorRowAt(E.cy);
 
   switch (key) {
     case ARROW_LEFT:
@@ -1029,7 +5622,7 @@ void editorMoveCursor(int key) {
         E.cx--;
       } else if (E.cy > 0) {
         E.cy--;
-        E.cx = E.row[E.cy].size;
+        E.cx = editorRowAt(E.cy)->size;
       }
       break;
     case ARROW_RIGHT:
@@ -1052,7 +5645,7 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = editorRowAt(E.cy);
   int rowlen = row ? row->size : 0;
   if (E.cx > rowlen) {
     E.cx = rowlen;
@@ -1063,6 +5656,9 @@ void editorProcessKeypress() {
   static int quit_times = MICRO_QUIT_TIMES;
 
   int c = editorReadKey();
+  long long t = nowNs();
+  int prompts = E.prof.prompts;
+  undoBegin();
 
   switch (c) {
     case '\r':
@@ -1092,13 +5688,33 @@ void editorProcessKeypress() {
       break;
 
     case END_KEY:
-      if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+      if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
       break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
 
+    case CTRL_KEY('g'):
+      editorGoto();
+      break;
+
+    case CTRL_KEY('e'):
+      editorCommand();
+      break;
+
+    case PASTE_KEY:
+      editorInsertText(E.paste, E.pastelen);
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1135,9 +5751,276 @@ void editorProcessKeypress() {
       break;
   }
 
+  undoSeal();
+  // a prompt times its own keys
+  if (E.prof.prompts == prompts) profAdd(PROF_EDIT, nowNs() - t);
   quit_times = MICRO_QUIT_TIMES;
 }
 
+/*** bench ***/
+
+// micro --bench [MB] [--size COLSxROWS] [--script FILE]: time the editor
+// on a generated file of about MB megabytes, without a terminal. Keys are
+// scripted through stdin, which is pointed at a file holding the script,
+// and every editorProcessKeypress is timed together with the frame drawn
+// after it. --script replaces the built-in scenarios with the raw keys in
+// FILE. Syntax files and their cache are kept in a scratch directory, so
+// the run does not depend on what is installed in ~/.config or ~/.cache
+
+struct benchOptions {
+  long long mb;
+  const char *script;
+  // dir - the scratch directory for syntax files and the syntax cache
+  char dir[32];
+};
+
+struct benchStats {
+  long long *ns;
+  int n;
+  int cap;
+};
+
+void benchAdd(struct benchStats *st, long long ns) {
+  if (st->n == st->cap) {
+    st->cap = st->cap ? st->cap * 2 : 64;
+    st->ns = realloc(st->ns, sizeof(long long) * st->cap);
+    if (st->ns == NULL) die("realloc");
+  }
+  st->ns[st->n++] = ns;
+}
+
+int benchCompare(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+void benchReport(const char *name, struct benchStats *st) {
+  if (st->n == 0) return;
+  qsort(st->ns, st->n, sizeof(long long), benchCompare);
+  char live[16], peak[16];
+  formatBytes(live, sizeof(live), E.mem_live);
+  formatBytes(peak, sizeof(peak), E.mem_peak);
+  printf("%-8s %6d ops  p50 %9.3f ms  p99 %9.3f ms  max %9.3f ms  %9lld B "
+         "drawn  %7s heap %7s peak\n",
+         name, st->n, st->ns[st->n / 2] / 1e6, st->ns[st->n * 99 / 100] / 1e6,
+         st->ns[st->n - 1] / 1e6, E.sink, live, peak);
+  fflush(stdout);
+  st->n = 0;
+}
+
+// live, peak and block counts of every tag
+void benchMemory() {
+  char live[16], peak[16];
+  int i;
+  printf("\n%-8s %9s %9s %10s\n", "memory", "live", "peak", "blocks");
+  for (i = 0; i < MEM_TAGS; i++) {
+    formatBytes(live, sizeof(live), E.mem[i].live);
+    formatBytes(peak, sizeof(peak), E.mem[i].peak);
+    printf("%-8s %9s %9s %10lld\n", mem_names[i], live, peak,
+           E.mem[i].blocks);
+  }
+  formatBytes(live, sizeof(live), E.mem_live);
+  formatBytes(peak, sizeof(peak), E.mem_peak);
+  printf("%-8s %9s %9s\n", "total", live, peak);
+}
+
+void benchUsage() {
+  fprintf(stderr,
+          "usage: micro --bench [MB] [--size COLSxROWS] [--script FILE]\n");
+  exit(1);
+}
+
+// parse the arguments after --bench; sets the virtual screen size, which
+// initEditor then keeps
+void benchArgs(int argc, char **argv, struct benchOptions *o) {
+  int i;
+  o->mb = 100;
+  o->script = NULL;
+  E.screenrows = MICRO_BENCH_ROWS;
+  E.screencols = MICRO_BENCH_COLS;
+  for (i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &E.screencols, &E.screenrows) != 2 ||
+          E.screencols < 1 || E.screenrows < 3)
+        benchUsage();
+    } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+      o->script = argv[++i];
+    } else if (isdigit((unsigned char)argv[i][0])) {
+      o->mb = atoll(argv[i]);
+      if (o->mb <= 0) benchUsage();
+    } else {
+      benchUsage();
+    }
+  }
+  // an empty syntax directory leaves only the built-in syntax
+  strcpy(o->dir, "/tmp/micro-bench-XXXXXX");
+  if (mkdtemp(o->dir) == NULL) die("mkdtemp");
+  setenv("MICRO_SYNTAX_DIR", o->dir, 1);
+  setenv("XDG_CACHE_HOME", o->dir, 1);
+}
+
+// remove the scratch directory and the syntax cache written into it
+void benchCleanup(struct benchOptions *o) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/micro/syntax.cache", o->dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/micro", o->dir);
+  rmdir(path);
+  rmdir(o->dir);
+}
+
+// run a script of keys through the editor, one sample per key
+void benchKeys(const char *name, struct benchStats *st, struct abuf *script) {
+  FILE *f = tmpfile();
+  if (f == NULL || fwrite(script->b, 1, script->len, f) != (size_t)script->len)
+    die("tmpfile");
+  rewind(f);
+  if (dup2(fileno(f), STDIN_FILENO) == -1) die("dup2");
+  fclose(f);
+  E.inlen = E.inpos = 0;
+  abFree(script);
+  *script = (struct abuf)ABUF_INIT;
+
+  E.sink = 0;
+  memResetPeak();
+  while (inputDepth() > 0) {
+    long long t = nowNs();
+    editorProcessKeypress();
+    editorRefreshScreen();
+    benchAdd(st, nowNs() - t);
+  }
+  benchReport(name, st);
+}
+
+// the keys timed when no --script is given
+void benchScenarios(struct benchStats *st, struct abuf *ab) {
+  char line[96];
+  int i;
+
+  // typing at the top of the file
+  for (i = 0; i < 2000; i++) abAppend(ab, "x", 1);
+  benchKeys("type", st, ab);
+
+  // bracketed pastes of 1 MB each
+  for (i = 0; i < 5; i++) {
+    abAppend(ab, "\x1b[200~", 6);
+    int start = ab->len;
+    while (ab->len - start < 1 << 20) {
+      int len = snprintf(line, sizeof(line), "pasted line %d\r", ab->len);
+      abAppend(ab, line, len);
+    }
+    abAppend(ab, "\x1b[201~", 6);
+  }
+  benchKeys("paste", st, ab);
+
+  // a search that scans the whole file and finds nothing; the query is
+  // pasted into the prompt so each sample is one scan
+  for (i = 0; i < 10; i++)
+    abAppend(ab, "\x06\x1b[200~zq_not_there\x1b[201~\r", 26);
+  benchKeys("search", st, ab);
+
+  // the same with a regex, toggled on with Ctrl-R
+  for (i = 0; i < 10; i++)
+    abAppend(ab, "\x06\x12\x1b[200~zq_[a-z]+_there\x1b[201~\r", 30);
+  benchKeys("regex", st, ab);
+
+  for (i = 0; i < 3; i++) abAppend(ab, "\x13", 1);
+  benchKeys("save", st, ab);
+}
+
+// edit in ways whose lexing is settled late, then compare every row's end
+// state with lexing the rows afresh. Returns whether they all agree
+int benchCheckSyntax() {
+  char *lines[] = {"x", "/*", "y", "z */", "w"};
+  int i, n = sizeof(lines) / sizeof(lines[0]);
+  E.filename = memStrdup(MEM_FILE, "check.c");
+  editorSelectSyntaxHighlight();
+  for (i = 0; i < n; i++) editorInsertRow(i, lines[i], strlen(lines[i]));
+  editorSyntaxSettle(INT_MAX, NULL);
+
+  // delete a row, then edit above it before the deletion has settled
+  editorDelRow(1);
+  editorRowInsertChar(editorRowAt(0), 0, 'q');
+  editorSyntaxSettle(INT_MAX, NULL);
+
+  int in_comment = 0, ok = 1;
+  for (i = 0; i < E.numrows; i++) {
+    erow *row = editorRowAt(i);
+    in_comment = editorSyntaxLexLine(row->chars, row->size, in_comment);
+    if (row->hl_open_comment != in_comment) {
+      fprintf(stderr, "syntax check: row %d ends in state %d, not %d\n", i,
+              row->hl_open_comment, in_comment);
+      ok = 0;
+    }
+  }
+  printf("\nsyntax check %s\n", ok ? "ok" : "FAILED");
+  return ok;
+}
+
+int editorBench(struct benchOptions *o) {
+  long long mb = o->mb;
+  char path[] = "/tmp/micro-bench-XXXXXX.c";
+  int fd = mkstemps(path, 2);
+  if (fd == -1) die("mkstemps");
+  struct abuf ab = ABUF_INIT;
+  char line[96];
+  long long size = 0;
+  int i = 0;
+  while (size < mb << 20) {
+    int len = snprintf(line, sizeof(line),
+                       "\tif (total > %d) total += values[%d] * %d; "
+                       "/* step %d */\n",
+                       i, i % 977, i % 31, i);
+    abAppend(&ab, line, len);
+    size += len;
+    i++;
+    if (ab.len >= 1 << 20 || size >= mb << 20) {
+      if (write(fd, ab.b, ab.len) != ab.len) die("write");
+      ab.len = 0;
+    }
+  }
+  close(fd);
+  printf("%s: %lld bytes, %d lines, %dx%d screen\n", path, size, i,
+         E.screencols, E.screenrows + 2);
+
+  struct benchStats st = {NULL, 0, 0};
+
+  // open, up to the first frame
+  abFree(&ab);
+  ab = (struct abuf)ABUF_INIT;
+  E.sink = 0;
+  memResetPeak();
+  for (i = 0; i < 5; i++) {
+    if (i > 0) editorClose();
+    long long t = nowNs();
+    editorOpen(path);
+    editorRefreshScreen();
+    benchAdd(&st, nowNs() - t);
+  }
+  benchReport("open", &st);
+
+  if (o->script) {
+    FILE *f = fopen(o->script, "rb");
+    if (f == NULL) die("fopen");
+    size_t n;
+    while ((n = fread(line, 1, sizeof(line), f)) > 0) abAppend(&ab, line, n);
+    fclose(f);
+    benchKeys("script", &st, &ab);
+  } else {
+    benchScenarios(&st, &ab);
+  }
+  benchMemory();
+
+  editorClose();
+  int ok = benchCheckSyntax();
+  editorClose();
+  unlink(path);
+  benchCleanup(o);
+  abFree(&ab);
+  free(st.ns);
+  return !ok;
+}
+
 /*** init ***/
 
 void initEditor() {
@@ -1147,28 +6030,89 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.rows = NULL;
+  E.orig = NULL;
+  E.origlen = 0;
+  E.origmapped = 0;
+  E.cache_head = NULL;
+  E.cache_tail = NULL;
+  E.cached = 0;
+  E.match_row = -1;
+  pthread_mutex_init(&E.search.lock, NULL);
+  pthread_cond_init(&E.search.wake, NULL);
+  pthread_cond_init(&E.search.idle, NULL);
+  editorSearchReset();
+  E.hl_from = INT_MAX;
+  E.hl_to = -1;
   E.dirty = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  // the size query's reply is read through the input buffer
+  E.inlen = 0;
+  E.inpos = 0;
+  // a headless editor was given its size by editorBench
+  if (!E.headless && getWindowSize(&E.screenrows, &E.screencols) == -1)
+    die("getWindowSize");
   E.screenrows -= 2;
+  E.frame_at = 0;
+  E.frame_keys = 0;
+  E.input_depth = 0;
+  E.nwatches = 0;
+  E.ntimers = 0;
+  editorPipe(E.winch);
+  editorWatchFd(E.winch[0], editorResize);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorWinch;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGWINCH, &sa, NULL);
+  editorPipe(E.search.notify);
+  editorWatchFd(E.search.notify[0], editorFindNotify);
+  editorPipe(E.lex.notify);
+  editorWatchFd(E.lex.notify[0], editorSyntaxLexNotify);
+  E.screen = NULL;
+  E.shadow = NULL;
+  E.paste = NULL;
+  E.pastelen = 0;
+  E.pastecap = 0;
+  memset(&E.undo, 0, sizeof(E.undo));
+  memset(&E.prof, 0, sizeof(E.prof));
+  E.undo.limit = MICRO_UNDO_LIMIT;
+  char *limit = getenv("MICRO_UNDO_LIMIT");
+  if (limit) E.undo.limit = strtoull(limit, NULL, 10);
+  E.lex_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char *threads = getenv("MICRO_LEX_THREADS");
+  if (threads) E.lex_threads = atoi(threads);
+  if (E.lex_threads > MICRO_LEX_THREADS) E.lex_threads = MICRO_LEX_THREADS;
+  editorSyntaxLoad();
+  screenResize();
+  screenInitAttrs();
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
+  int bench = argc >= 2 && strcmp(argv[1], "--bench") == 0;
+  struct benchOptions bo;
+  if (bench) {
+    E.headless = 1;
+    benchArgs(argc - 2, argv + 2, &bo);
+  } else {
+    enableRawMode();
+  }
   initEditor();
+  if (bench) return editorBench(&bo);
   if (argc >= 2) {
     editorOpen(argv[1]);
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  // one line that fits an 80 column terminal
+  editorSetStatusMessage("HELP: Ctrl-S save, Q quit, F find (R regex), "
+                         "Z/Y undo/redo, G goto, E command");
 
   while (1) {
-    editorRefreshScreen();
+    editorScheduleFrame();
     editorProcessKeypress();
   }
 